@@ -8,22 +8,47 @@
 #include <sys/socket.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <arpa/telnet.h>
 #include <netinet/in.h>
+#ifdef __linux__
+# include <linux/tcp.h>
+#else
+# include <netinet/tcp.h>
+#endif
 #include <netdb.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <limits.h>
+#include <locale.h>
+#include <wchar.h>
+#define NCURSES_WIDECHAR 1
 #include <ncurses.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <regex.h>
 
 #ifdef HAVE_ZLIB
 # include <zlib.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define HAVE_SIMD_SCAN
+#endif
+
 #include "libtelnet.h"
 
 /* telnet protocol */
@@ -32,55 +57,510 @@ static telnet_t *telnet;
 static const telnet_telopt_t telnet_telopts[] = {
 	{ TELNET_TELOPT_ECHO, 		TELNET_WONT, TELNET_DO   },
 	{ TELNET_TELOPT_NAWS, 		TELNET_WILL, TELNET_DONT },
+#ifdef HAVE_ZLIB
 	{ TELNET_TELOPT_COMPRESS2,	TELNET_WONT, TELNET_DO   },
+#endif
 	{ TELNET_TELOPT_ZMP, 		TELNET_WONT, TELNET_DO   },
+	{ TELNET_TELOPT_CHARSET,	TELNET_WILL, TELNET_DO   },
 	{ -1, 0, 0 }
 };
 
 static void telnet_event(telnet_t* telnet, telnet_event_t *event, void*);
 static void send_line(const char* line, size_t len);
+static void do_input(const char* line, size_t len);
 static void send_naws(void);
 
 static void do_zmp(size_t argc, const char **argv);
+static struct ZMPCMD* zmp_find(const char* name, size_t len);
+
+#ifdef HAVE_ZLIB
+/* MCCP2 decompression; the start marker is stripped before libtelnet
+ * sees it, and everything after it is inflated until the stream ends */
+static struct MCCP {
+	z_stream zs;
+	int active;
+	size_t match;
+	size_t held;
+	size_t in_bytes;
+	size_t out_bytes;
+} mccp;
+
+static void mccp_recv(const char* bytes, size_t len);
+static void mccp_end(void);
+#endif
+
+/* CHARSET (RFC 2066); server text in a legacy charset is turned into
+ * UTF-8 through a table holding the encoding of every byte, before the
+ * terminal sees it, and commands are mapped back the other way */
+#define CHARSET_REQUEST 1
+#define CHARSET_ACCEPTED 2
+#define CHARSET_REJECTED 3
+#define CHARSET_TTABLE_IS 4
+#define CHARSET_TTABLE_REJECTED 5
+
+struct CHARSET {
+	const char* name;
+	const char* alias;
+	const unsigned short* high;
+	int legacy;
+};
+
+/* a byte's UTF-8 encoding, padded so it can always be copied whole */
+struct CHARSETCODE {
+	char bytes[3];
+	unsigned char len;
+};
+
+static const struct CHARSET charsets[];
+
+static struct CHARSETSTATE {
+	const struct CHARSET* current;
+	struct CHARSETCODE table[256];
+	char* buf;
+	size_t size;
+} charset;
+
+static const struct CHARSET* charset_find(const char* name, size_t len);
+static void charset_select(const struct CHARSET* cs);
+static const char* charset_decode(const char* text, size_t* len);
+static size_t charset_encode(const char* text, size_t len, char* out);
+static void charset_request(void);
+static void charset_sb(const char* buf, size_t size);
+static void charset_free(void);
+
+/* zmp commands; the static table is loaded into a hash table at startup,
+ * with a second table of every package prefix ("zmp.", "color.") so that
+ * zmp.check never has to scan */
+#define ZMP_BUCKETS 64
 
-/* zmp commands */
 struct ZMP {
 	const char* name;
 	void (*cb)(size_t argc, const char* argv[]);
 };
 
+struct ZMPCMD {
+	struct ZMPCMD* next;
+	void (*cb)(size_t argc, const char* argv[]);
+	char name[];
+};
+
+struct ZMPPKG {
+	struct ZMPPKG* next;
+	size_t len;
+	char name[];
+};
+
 static struct ZMP zmp_registry[];
+static struct ZMPCMD* zmp_commands[ZMP_BUCKETS];
+static struct ZMPPKG* zmp_packages[ZMP_BUCKETS];
+
+static void zmp_init(void);
+static void zmp_free(void);
+static void zmp_register(const char* name, void (*cb)(size_t argc, const char* argv[]));
+
+/* printable run scanners and substring finders; the fastest ones the cpu
+ * supports are picked at startup, and --bench times all of them */
+struct SCANNER {
+	const char* name;
+	size_t (*scan)(const char* text, size_t len);
+	const char* (*find)(const char* hay, size_t len, const char* needle, size_t nlen);
+	int usable;
+};
+
+static struct SCANNER scanners[];
+static size_t (*term_run_length)(const char* text, size_t len);
+static const char* (*search_find)(const char* hay, size_t len, const char* needle, size_t nlen);
+static const char* find_last(const char* hay, size_t len, const char* needle, size_t nlen);
+
+static void scan_init(void);
+
+/* utf-8; server text is decoded a byte at a time, so sequences split
+ * across reads come out whole, and malformed bytes each become U+FFFD.
+ * column widths come from a table of the zero and double width ranges
+ * of Unicode, expanded at startup to two bits per BMP character */
+#define UTF8_BATCH 256
+#define UTF8_REPLACEMENT 0xfffd
+#define UTF8_NONE ((unsigned int)-1)
+
+struct WIDTHRANGE {
+	unsigned int first;
+	unsigned int last;
+	unsigned char width;
+};
+
+static const struct WIDTHRANGE width_ranges[];
+static unsigned char width_bmp[0x10000 / 4];
+
+static void width_init(void);
+static size_t utf8_ascii_length(const char* text, size_t len);
+static size_t utf8_decode(const char* text, size_t len, unsigned int* cp);
+static size_t utf8_char(const char* text, size_t len, unsigned int* cp);
+static size_t utf8_encode(unsigned int cp, char* out);
+static int char_width(unsigned int cp);
+
+/* the server line being assembled, already free of ANSI codes, for the
+ * triggers and the session log */
+#define TEXTLINE_MAX 4096
+
+static struct TEXTLINE {
+	char buf[TEXTLINE_MAX + 1];
+	size_t len;
+	size_t cols;
+} textline;
+
+static void textline_write(const char* text, size_t len, size_t cols);
+static void textline_control(char c);
+
+/* triggers; the longest literal each pattern requires goes into a single
+ * Aho-Corasick automaton, so a line only runs the regexes of triggers
+ * whose literal it contains */
+typedef enum { TRIGGER_SEND, TRIGGER_GAG, TRIGGER_HIGHLIGHT } trigger_action_t;
+
+struct TRIGGER {
+	char* pattern;
+	regex_t re;
+	trigger_action_t action;
+	char* arg;
+	short color;
+	int ac_next;
+	size_t seen;
+	size_t hits;
+	size_t checks;
+	double time;
+};
+
+struct ACSTATE {
+	int next[256];
+	int fail;
+	int out;
+	int link;
+};
+
+static struct TRIGGERS {
+	struct TRIGGER* list;
+	size_t count;
+	size_t size;
+	struct ACSTATE* states;
+	size_t nstates;
+	size_t states_size;
+	int* always;
+	size_t nalways;
+	int* cand;
+	size_t lines;
+	size_t candidates;
+	double time;
+} triggers;
+
+static void trigger_load(const char* path);
+static void trigger_line(void);
+static void trigger_report(void);
+static void trigger_free(void);
+
+/* session log; the UI thread appends finished lines to a lock-free single
+ * producer, single consumer ring, and a writer thread batches them out to
+ * disk, so a slow disk never stalls the display */
+#define LOG_RING_SIZE (1024 * 1024)
+#define LOG_FLUSH_MS 100
+#define LOG_SYNC_SECS 1.0
+
+#ifdef HAVE_ZLIB
+/* compressed logs are a run of independently deflated blocks, each headed
+ * by its raw and compressed sizes and the wall clock times (to within the
+ * flush interval) of its first and last lines; an index of block offsets
+ * and a trailer follow the last block, so a reader can seek by time and
+ * inflate only the blocks it wants, or hop from header to header when the
+ * trailer is missing */
+#define LOG_BLOCK_SIZE (64 * 1024)
+#define LOG_BLOCK_SECS 10.0
+#define LOG_ZLIB_LEVEL 3
+#define LOG_BLOCK_HEADER 24
+#define LOG_INDEX_ENTRY 24
+#define LOG_TRAILER 20
+#define LOG_MAGIC "CLCLOG1\n"
+#define LOG_INDEX_MAGIC "CLCIDX1\n"
+
+struct LOGBLOCK {
+	unsigned long long offset;
+	unsigned long long first_us;
+	unsigned long long last_us;
+};
+#endif
+
+static struct SESSIONLOG {
+	int active;
+	int block;
+	int fd;
+	char* ring;
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_int stop;
+	int wake[2];
+	pthread_t thread;
+	size_t lines;
+	size_t dropped;
+	size_t blocked;
+	size_t high_water;
+	atomic_size_t written;
+	atomic_size_t writes;
+	atomic_size_t busy_us;
+	atomic_int error;
+	double start;
+	double elapsed;
+#ifdef HAVE_ZLIB
+	int zlib;
+	z_stream zs;
+	char* raw;
+	size_t raw_len;
+	char* zbuf;
+	size_t zbuf_size;
+	double block_start;
+	unsigned long long first_us;
+	unsigned long long last_us;
+	unsigned long long offset;
+	struct LOGBLOCK* index;
+	size_t blocks;
+	size_t index_size;
+	atomic_size_t raw_bytes;
+	atomic_size_t zlib_bytes;
+	atomic_size_t cpu_ns;
+#endif
+} sessionlog;
+
+static void log_open(const char* path);
+static void log_line(const char* text, size_t len);
+static void log_close(void);
+static void log_report(void);
+#ifdef HAVE_ZLIB
+static int log_dump(const char* path, double since);
+#endif
+
+/* aliases; the first word of every sent line is looked up, and an
+ * expansion may use $1-$9 and $* and hold several commands split by ';'.
+ * a command naming an alias already being expanded is sent as it is, so
+ * an alias may start with its own name */
+#define ALIAS_BUCKETS 64
+#define ALIAS_DEPTH_MAX 8
+#define ALIAS_CMD_MAX 4096
+#define ALIAS_COMMANDS_MAX 256
+
+struct ALIAS {
+	struct ALIAS* next;
+	char* body;
+	char name[];
+};
+
+static struct ALIAS* aliases[ALIAS_BUCKETS];
+
+/* commands produced by one sent line, written out together, and the
+ * chain of aliases being expanded for it */
+static struct CMDBUF {
+	char* buf;
+	size_t size;
+	size_t len;
+	struct ALIAS* chain[ALIAS_DEPTH_MAX];
+	size_t commands;
+	int capped;
+	int truncated;
+} cmdbuf;
+
+static void alias_load(const char* path);
+static void alias_expand(const char* line, size_t len, int depth);
+static void alias_free(void);
 
-/* terminal processing */
-typedef enum { TERM_ASCII, TERM_ESC, TERM_ESCRUN } term_state_t;
+/* terminal processing; a table driven parser following the DEC VT500
+ * state diagram, minus the C1 controls since high bytes are text here */
+typedef enum {
+	TERM_GROUND,
+	TERM_ESCAPE,
+	TERM_ESCAPE_INTER,
+	TERM_CSI_ENTRY,
+	TERM_CSI_PARAM,
+	TERM_CSI_INTER,
+	TERM_CSI_IGNORE,
+	TERM_OSC_STRING,
+	TERM_SOS_STRING,
+	TERM_STATES
+} term_state_t;
+
+/* parser actions, stored in the high nibble of a table entry */
+typedef enum {
+	TERM_ACT_NONE,
+	TERM_ACT_EXECUTE,
+	TERM_ACT_CLEAR,
+	TERM_ACT_COLLECT,
+	TERM_ACT_PARAM,
+	TERM_ACT_ESC_DISPATCH,
+	TERM_ACT_CSI_DISPATCH
+} term_action_t;
 
 #define TERM_MAX_ESC 16
+#define TERM_MAX_PARAM 65535
 #define TERM_COLOR_DEFAULT 9
 
+/* SGR colors are -1 for the default, 0-255 for palette entries, or
+ * TERM_RGB plus 24 bits of red, green and blue */
+#define TERM_COLOR_NONE -1
+#define TERM_RGB 0x1000000
+
 #define TERM_FLAG_ECHO (1<<0)
 #define TERM_FLAG_ZMP (1<<1)
 #define TERM_FLAG_NAWS (1<<2)
 #define TERM_FLAGS_DEFAULT (TERM_FLAG_ECHO)
 
+static unsigned char term_table[TERM_STATES][256];
+
 static struct TERMINAL {
 	term_state_t state;
 	int esc_buf[TERM_MAX_ESC];
 	size_t esc_cnt;
+	char collect;
 	char flags;
-	int color;
+	int fg;
+	int bg;
+	attr_t attrs;
+	unsigned int utf8_cp;
+	unsigned int utf8_min;
+	int utf8_left;
 } terminal;
 
-/* edit buffer */
+/* color pairs; (fg, bg) combinations are mapped onto curses pairs
+ * through a hash table, and the least recently used pair is recycled
+ * once they run out.  COLOR_PAIR() only has 8 bits in a chtype, and
+ * pairs below PAIR_FIRST are set up statically in main().  Redefining a
+ * pair recolors every cell that uses it, so a pair still on screen is
+ * only recycled when all of them are; the screen is looked over only
+ * when the pairs last seen to be off it are used up.  Scrollback lines
+ * keep their pair numbers, and ones off screen may come back in the
+ * recycled colors. */
+#define PAIR_FIRST 12
+#define PAIR_MAX 256
+#define PAIR_BUCKETS 64
+
+struct COLORPAIR {
+	short fg;
+	short bg;
+	short hnext;
+	short prev;
+	short next;
+};
+
+static struct PAIRCACHE {
+	struct COLORPAIR pairs[PAIR_MAX];
+	short buckets[PAIR_BUCKETS];
+	short head;
+	short tail;
+	short count;
+	short limit;
+	unsigned char to16[256];
+	unsigned char spare[PAIR_MAX];
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+} paircache;
+
+/* scrollback; lines are stored as cells of a character and attributes,
+ * one per character whatever its width (zero width ones only make it to
+ * the live window), in a chunked arena, and chunks are recycled once
+ * every line in them has aged out of the ring; the plain text of every
+ * line is also kept, as newline terminated UTF-8, in one contiguous
+ * buffer addressed by ever-growing offsets, for searching */
+#define SCROLLBACK_DEFAULT 10000
+#define SCROLL_LINE_MAX 1024
+#define SCROLL_CHUNK_CELLS 16384
+#define SCROLL_TEXT_MIN (64 * 1024)
+
+struct SCROLLCELL {
+	wchar_t ch;
+	attr_t attr;
+};
+
+struct SCROLLCHUNK {
+	struct SCROLLCHUNK* next;
+	size_t used;
+	size_t lines;
+	struct SCROLLCELL cells[SCROLL_CHUNK_CELLS];
+};
+
+struct SCROLLLINE {
+	struct SCROLLCHUNK* chunk;
+	struct SCROLLCELL* cells;
+	size_t len;
+	size_t text;
+	size_t bytes;
+};
+
+static struct SCROLLBACK {
+	struct SCROLLLINE* lines;
+	size_t max;
+	size_t head;
+	size_t count;
+	struct SCROLLCHUNK* chunk;
+	struct SCROLLCHUNK* free;
+	size_t chunks;
+	struct SCROLLCELL cur[SCROLL_LINE_MAX];
+	size_t curlen;
+	size_t curcols;
+	size_t offset;
+	char* text;
+	size_t text_size;
+	size_t text_base;
+	size_t text_tail;
+	size_t text_head;
+} scrollback;
 
-#define EDITBUF_MAX 1024
+/* scrollback search; the typed text is looked for in the plain text of
+ * the scrollback, newest to oldest, a slice per main loop iteration so a
+ * long history never holds up the socket */
+#define SEARCH_MAX 256
+#define SEARCH_SLICE (4 * 1024 * 1024)
+#define SEARCH_NONE ((size_t)-1)
+
+static struct SEARCH {
+	int active;
+	int pending;
+	char pattern[SEARCH_MAX];
+	size_t len;
+	size_t origin;
+	size_t start;
+	size_t from;
+	size_t match;
+	size_t scanned;
+	double busy;
+} search;
+
+static void search_start(void);
+static int search_key(int key);
+static void search_step(void);
+static void search_display(void);
+static const struct SCROLLCELL* search_mark(const struct SCROLLLINE* line, struct SCROLLCELL* out);
+
+/* edit buffer; a gap buffer holding the text before the cursor at the
+ * start of buf and the text after it at the end, so typing and deleting
+ * at the cursor are O(1), and only moving the cursor moves text; the line
+ * scrolls sideways to keep the cursor in view, and only the part from the
+ * first change onwards is redrawn */
+#define EDITBUF_MIN 256
+#define EDITBUF_CLEAN ((size_t)-1)
 
 static struct EDITBUF {
-	char buf[EDITBUF_MAX];
+	char* buf;
 	size_t size;
 	size_t pos;
+	size_t gap;
+	size_t scroll;
+	size_t changed;
+	int full;
+	int masked;
+	char partial[4];
+	size_t pending;
+	size_t need;
 } editbuf;
 
 static void editbuf_set(const char*);
+static void editbuf_setn(const char*, size_t);
+static size_t editbuf_len(void);
+static const char* editbuf_text(size_t* len);
+static void editbuf_copy(char* out);
 static void editbuf_insert(int);
 static void editbuf_bs();
 static void editbuf_del();
@@ -90,15 +570,77 @@ static void editbuf_display();
 static void editbuf_home();
 static void editbuf_end();
 
+#define CTRL_KEY(c) ((c) & 0x1f)
+
+/* input history; entries are kept newline terminated, oldest first, in a
+ * memory-mapped file (or plain memory without -H) behind a small header,
+ * so startup only maps it and every new entry is an append; recall walks
+ * back through it with the substring finders, and the oldest quarter is
+ * dropped whenever the ring fills, by writing what is kept to a new file
+ * and renaming it over the old one */
+#define HISTORY_MAGIC "CLCHIST1"
+#define HISTORY_MAX 100000
+#define HISTORY_SIZE_MIN (64 * 1024)
+#define HISTORY_NONE ((size_t)-1)
+
+struct HISTHEADER {
+	char magic[8];
+	unsigned long long used;
+	unsigned long long count;
+};
+
+#define HISTORY_PATTERN_MAX 256
+
+static struct HISTORY {
+	const char* path;
+	int fd;
+	char* map;
+	size_t size;
+	struct HISTHEADER* header;
+	char* text;
+	size_t pos;
+	char* saved;
+	size_t saved_len;
+	char* prefix;
+	size_t prefix_len;
+	int searching;
+	char pattern[HISTORY_PATTERN_MAX];
+	size_t len;
+	size_t match;
+	size_t match_end;
+} history;
+
+static void history_open(const char* path);
+static void history_add(const char* line, size_t len);
+static void history_prev(void);
+static void history_next(void);
+static void history_search_start(void);
+static int history_key(int key);
+static void history_display(void);
+static void history_close(void);
+
 /* running flag; when 0, exit main loop */
 static int running = 1;
 
 /* banner buffer */
 static char banner[1024];
+static char banner_painted[1024];
 static int autobanner = 1;
 
+/* dirty windows; output is repainted at most max_fps times a second,
+ * input is always repainted right away */
+#define DIRTY_MAIN (1<<0)
+#define DIRTY_BANNER (1<<1)
+#define DIRTY_INPUT (1<<2)
+#define FPS_DEFAULT 30
+
+static int dirty = 0;
+static int max_fps = FPS_DEFAULT;
+static struct timespec last_paint;
+
 /* windows */
 static WINDOW* win_main = 0;
+static WINDOW* win_scroll = 0;
 static WINDOW* win_input = 0;
 static WINDOW* win_banner = 0;
 
@@ -113,16 +655,131 @@ static int sock;
 static size_t sent_bytes = 0;
 static size_t recv_bytes = 0;
 
+/* outbound statistics; output is flushed once per loop iteration, so a
+ * batch of commands costs one write */
+static size_t sent_commands = 0;
+static size_t sent_writes = 0;
+static long sent_segments = -1;
+
+/* connection attempts */
+#define CONNECT_MAX 16
+#define CONNECT_DELAY_MS 250
+#define CONNECT_TIMEOUT_DEFAULT 30
+
+static int connect_timeout = CONNECT_TIMEOUT_DEFAULT;
+static char connect_addr[NI_MAXHOST];
+static char connect_error[256];
+static double connect_time;
+
+/* connections are made on a separate thread, which reports each state
+ * change as one byte down a pipe that the main loop polls; everything
+ * else it sets is only read after it has been joined */
+typedef enum { CONN_NONE, CONN_RESOLVING, CONN_CONNECTING, CONN_OPEN, CONN_FAILED } conn_state_t;
+
+static conn_state_t conn_state = CONN_NONE;
+static pthread_t connect_thread;
+static int connect_pipe[2] = { -1, -1 };
+static int connect_sock = -1;
+
+/* socket options, set from -o or #set; -1 leaves the kernel default.  The
+ * connect thread applies them, so #set only changes them once it is done */
+struct SOCKOPT {
+	const char* name;
+	int level;
+	int opt;
+	int value;
+};
+
+static struct SOCKOPT sockopts[];
+
+static struct SOCKOPT* sockopt_parse(const char* name, const char* value);
+static void sockopt_apply(int fd);
+
+/* receive buffer; the socket is drained into it on every wakeup */
+#define RECVBUF_DEFAULT 65536
+#define RECVBUF_MIN 512
+#define RECV_BURST_MAX (1024 * 1024)
+
+static char* recvbuf = NULL;
+static size_t recvbuf_size = RECVBUF_DEFAULT;
+static size_t recv_wakeups = 0;
+static size_t recv_burst_max = 0;
+
+/* session capture; a header followed by records of a direction byte,
+ * microseconds since the previous record and a length (both as LEB128
+ * varints), then the raw bytes */
+#define CAPTURE_MAGIC "CLCCAP\001\n"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_RECV 1
+#define CAPTURE_SEND 2
+#define CAPTURE_BUFFER (1024 * 1024)
+
+static FILE* capture = NULL;
+static double capture_last;
+
+/* recorded session being replayed; raw files hold only server output,
+ * captures are fed record by record, optionally at the recorded speed */
+static struct REPLAY {
+	char* data;
+	size_t size;
+	size_t off;
+	int capture;
+	int realtime;
+	double start;
+	double clock;
+} replay;
+
+/* replay benchmark; stage times are in seconds */
+static struct BENCH {
+	int active;
+	size_t events;
+	double telnet;
+	double render;
+	double charset;
+	double refresh;
+} bench;
+
+/* outbound queue; a ring buffer flushed whenever the socket is writable */
+#define SENDQ_MIN 4096
+
+static struct SENDQ {
+	char* buf;
+	size_t size;
+	size_t head;
+	size_t len;
+} sendq;
+
 /* core functions */
+static void capture_write (int dir, const char* bytes, size_t len);
+static void connect_notify (conn_state_t state);
+static void scrollback_render (void);
+static void paircache_forget (void);
 static void on_text_plain (const char* text, size_t len);
 static void on_text_ansi (const char* text, size_t len);
+static void on_warning (const char* msg);
+static void on_info (const char* fmt, ...);
 
 /* ======= CORE ======= */
 
+/* FNV-1a hash of a name */
+static unsigned int hash_name (const char* name, size_t len) {
+	unsigned int hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i != len; ++i) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 /* cleanup function */
 static void cleanup (void) {
 	/* cleanup curses */
 	endwin();
+
+	/* write out whatever the log still holds */
+	log_close();
 }
 
 /* handle signals */
@@ -137,114 +794,397 @@ static void handle_signal (int sig) {
 	}
 }
 
+/* current monotonic time in seconds */
+static double now_sec (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* make room for len more bytes, always leaving a byte of gap spare */
+static void editbuf_reserve (size_t len) {
+	size_t tail = editbuf.size - editbuf.gap;
+	size_t size = editbuf.size != 0 ? editbuf.size : EDITBUF_MIN;
+	char* buf;
+
+	if (editbuf.gap - editbuf.pos > len)
+		return;
+	while (size - editbuf.pos - tail <= len)
+		size *= 2;
+
+	buf = (char*)realloc(editbuf.buf, size);
+	if (buf == NULL) {
+		endwin();
+		fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	memmove(buf + size - tail, buf + editbuf.gap, tail);
+	editbuf.buf = buf;
+	editbuf.gap = size - tail;
+	editbuf.size = size;
+}
+
+/* length of the text */
+static size_t editbuf_len (void) {
+	return editbuf.size - (editbuf.gap - editbuf.pos);
+}
+
+/* move the cursor, and the gap with it */
+static void editbuf_move (size_t pos) {
+	size_t n;
+
+	if (pos < editbuf.pos) {
+		n = editbuf.pos - pos;
+		editbuf.gap -= n;
+		memmove(editbuf.buf + editbuf.gap, editbuf.buf + pos, n);
+	} else if (pos > editbuf.pos) {
+		n = pos - editbuf.pos;
+		memmove(editbuf.buf + editbuf.pos, editbuf.buf + editbuf.gap, n);
+		editbuf.gap += n;
+	}
+	editbuf.pos = pos;
+}
+
+/* the whole text in one piece, nul terminated; this closes up the gap by
+ * moving the cursor to the end */
+static const char* editbuf_text (size_t* len) {
+	editbuf_reserve(0);
+	editbuf_move(editbuf_len());
+	editbuf.buf[editbuf.pos] = '\0';
+	*len = editbuf.pos;
+	return editbuf.buf;
+}
+
+/* copy the text out in its two pieces, leaving the cursor and gap alone */
+static void editbuf_copy (char* out) {
+	memcpy(out, editbuf.buf, editbuf.pos);
+	memcpy(out + editbuf.pos, editbuf.buf + editbuf.gap, editbuf.size - editbuf.gap);
+}
+
 /* set the edit buffer to contain the given text */
+static void editbuf_setn (const char* text, size_t len) {
+	editbuf.pos = 0;
+	editbuf.gap = editbuf.size;
+	editbuf_reserve(len);
+	memcpy(editbuf.buf, text, len);
+	editbuf.pos = len;
+	editbuf.scroll = 0;
+	editbuf.pending = 0;
+	editbuf.full = 1;
+}
+
 static void editbuf_set (const char* text) {
-	snprintf(editbuf.buf, EDITBUF_MAX, "%s", text);
-	editbuf.pos = editbuf.size = strlen(text);
+	editbuf_setn(text, strlen(text));
+}
+
+/* note that everything from pos on needs redrawing */
+static void editbuf_changed (size_t pos) {
+	if (pos < editbuf.changed)
+		editbuf.changed = pos;
+}
+
+/* byte i of the text, skipping over the gap */
+static unsigned char editbuf_at (size_t i) {
+	if (i < editbuf.pos)
+		return (unsigned char)editbuf.buf[i];
+	return (unsigned char)editbuf.buf[editbuf.gap + (i - editbuf.pos)];
+}
+
+/* decode the character at text position i, returning its length */
+static size_t editbuf_char (size_t i, unsigned int* cp) {
+	char bytes[4];
+	size_t len = editbuf_len();
+	size_t n;
+
+	for (n = 0; n != sizeof(bytes) && i + n != len; ++n)
+		bytes[n] = (char)editbuf_at(i + n);
+	return utf8_char(bytes, n, cp);
+}
+
+/* start of the character before text position i */
+static size_t editbuf_prev (size_t i) {
+	do
+		--i;
+	while (i != 0 && (editbuf_at(i) & 0xc0) == 0x80);
+	return i;
 }
 
-/* insert/replace a character at the current location */
+/* columns a character takes on the input line */
+static size_t editbuf_width (unsigned int cp) {
+	if (editbuf.masked || cp < 0x80)
+		return 1;
+	return (size_t)char_width(cp);
+}
+
+/* columns taken by text positions [from, to) */
+static size_t editbuf_cols (size_t from, size_t to) {
+	unsigned int cp;
+	size_t cols = 0;
+
+	while (from < to) {
+		from += editbuf_char(from, &cp);
+		cols += editbuf_width(cp);
+	}
+	return cols;
+}
+
+/* insert a byte at the cursor; control characters are ignored, and the
+ * bytes of a UTF-8 sequence are held back until it is whole, so the cursor
+ * and the gap only ever sit between characters */
 static void editbuf_insert (int ch) {
-	/* ensure we have space */
-	if (editbuf.size == EDITBUF_MAX)
-		return;
+	unsigned int cp;
 
-	/* if we're at the end, just append the character */
-	if (editbuf.pos == editbuf.size) {
-		editbuf.buf[editbuf.pos] = ch;
-		editbuf.pos = ++editbuf.size;
+	if (ch < 0x20 || ch == 0x7f || ch > 0xff)
 		return;
+
+	if ((ch & 0xc0) == 0x80) {
+		/* a continuation byte with no sequence to go in */
+		if (editbuf.pending == 0)
+			return;
+	} else {
+		/* a new character drops any sequence left unfinished */
+		editbuf.pending = 0;
+		editbuf.need = ch < 0x80 ? 1 : ch >= 0xc2 && ch <= 0xdf ? 2 :
+				ch >= 0xe0 && ch <= 0xef ? 3 : ch >= 0xf0 && ch <= 0xf4 ? 4 : 0;
+		if (editbuf.need == 0)
+			return;
 	}
+	editbuf.partial[editbuf.pending++] = (char)ch;
+	if (editbuf.pending != editbuf.need)
+		return;
+	editbuf.pending = 0;
 
-	/* move data, insert character */
-	memmove(editbuf.buf + editbuf.pos + 1, editbuf.buf + editbuf.pos, editbuf.size - editbuf.pos);
-	editbuf.buf[editbuf.pos] = ch;
-	++editbuf.pos;
-	++editbuf.size;
+	/* overlong forms and surrogates decode to the replacement character */
+	utf8_char(editbuf.partial, editbuf.need, &cp);
+	if (cp == UTF8_REPLACEMENT && memcmp(editbuf.partial, "\xef\xbf\xbd", 3) != 0)
+		return;
+
+	editbuf_reserve(editbuf.need);
+	editbuf_changed(editbuf.pos);
+	memcpy(editbuf.buf + editbuf.pos, editbuf.partial, editbuf.need);
+	editbuf.pos += editbuf.need;
 }
 
 /* delete character one position to the left */
 static void editbuf_bs () {
-	/* if we're at the beginning, do nothing */
 	if (editbuf.pos == 0)
 		return;
 
-	/* if we're at the end, just decrement pos and size */
-	if (editbuf.pos == editbuf.size) {
-		editbuf.pos = --editbuf.size;
-		return;
-	}
-
-	/* chop out the previous character */
-	memmove(editbuf.buf + editbuf.pos - 1, editbuf.buf + editbuf.pos, editbuf.size - editbuf.pos);
-	--editbuf.pos;
-	--editbuf.size;
+	editbuf.pos = editbuf_prev(editbuf.pos);
+	editbuf_changed(editbuf.pos);
 }
 
-/* delete word under cursor */
+/* delete the character under the cursor */
 static void editbuf_del () {
-	/* if we're at the end, do nothing */
-	if (editbuf.pos == editbuf.size)
-		return;
+	unsigned int cp;
 
-	/* if we're at the end, just decrement pos and size */
-	if (editbuf.pos == editbuf.size - 1) {
-		--editbuf.pos;
-		--editbuf.size;
+	if (editbuf.gap == editbuf.size)
 		return;
-	}
 
-	/* chop out the current character */
-	memmove(editbuf.buf + editbuf.pos, editbuf.buf + editbuf.pos + 1, editbuf.size - editbuf.pos - 1);
-	--editbuf.size;
+	editbuf.gap += editbuf_char(editbuf.pos, &cp);
+	editbuf_changed(editbuf.pos);
 }
 
 /* move to home position */
 static void editbuf_home () {
-	editbuf.pos = 0;
+	editbuf_move(0);
 }
 
 /* move to end position */
 static void editbuf_end () {
-	editbuf.pos = editbuf.size;
+	editbuf_move(editbuf_len());
 }
 
 /* move cursor left */
 static void editbuf_curleft () {
 	if (editbuf.pos > 0)
-		--editbuf.pos;
+		editbuf_move(editbuf_prev(editbuf.pos));
 }
 
 /* move cursor right */
 static void editbuf_curright () {
-	if (editbuf.pos < editbuf.size)
-		++editbuf.pos;
+	unsigned int cp;
+
+	if (editbuf.gap < editbuf.size)
+		editbuf_move(editbuf.pos + editbuf_char(editbuf.pos, &cp));
+}
+
+/* draw text positions [from, to) starting at column col, decoded in
+ * batches */
+static void editbuf_draw (size_t from, size_t to, size_t col) {
+	wchar_t wbuf[UTF8_BATCH];
+	unsigned int cp;
+	int n = 0;
+
+	wmove(win_input, 0, (int)col);
+	while (from < to) {
+		from += editbuf_char(from, &cp);
+		wbuf[n++] = editbuf.masked ? L'*' : (wchar_t)cp;
+		if (n == UTF8_BATCH) {
+			waddnwstr(win_input, wbuf, n);
+			n = 0;
+		}
+	}
+	if (n != 0)
+		waddnwstr(win_input, wbuf, n);
 }
 
 /* display the edit buffer in win_input */
 static void editbuf_display () {
-	wclear(win_input);
-	if (terminal.flags & TERM_FLAG_ECHO) {
-		mvwaddnstr(win_input, 0, 0, editbuf.buf, editbuf.size);
-	} else {
-		wmove(win_input, 0, 0);
-		size_t i;
-		for (i = 0; i != editbuf.size; ++i)
-			waddch(win_input, '*');
+	size_t cols = getmaxx(win_input);
+	size_t len = editbuf_len();
+	size_t end, col, endcol, n, w;
+	unsigned int cp;
+	int masked = !(terminal.flags & TERM_FLAG_ECHO);
+
+	dirty |= DIRTY_INPUT;
+
+	/* the prompts take the whole line, and leave it to be redrawn */
+	if (search.active || history.searching) {
+		werase(win_input);
+		if (search.active)
+			search_display();
+		else
+			history_display();
+		editbuf.full = 1;
+		return;
+	}
+
+	/* masking changes every width, so settle it first */
+	if (masked != editbuf.masked) {
+		editbuf.masked = masked;
+		editbuf.full = 1;
+	}
+
+	/* keep the cursor in view, jumping half a line at a time; scroll is a
+	 * text position, always at the start of a character */
+	if (editbuf.pos < editbuf.scroll || editbuf_cols(editbuf.scroll, editbuf.pos) >= cols) {
+		editbuf.scroll = editbuf.pos;
+		for (col = 0; editbuf.scroll != 0; col += w) {
+			n = editbuf_prev(editbuf.scroll);
+			editbuf_char(n, &cp);
+			w = editbuf_width(cp);
+			if (col + w > cols / 2)
+				break;
+			editbuf.scroll = n;
+		}
+		editbuf.full = 1;
+	}
+	if (editbuf.full) {
+		editbuf.changed = editbuf.scroll;
+		editbuf.full = 0;
+	}
+
+	/* redraw from the first change to the right edge, stopping short of a
+	 * character that would not fit whole; the last column is left alone
+	 * by wclrtoeol() when text fills it */
+	if (editbuf.changed != EDITBUF_CLEAN) {
+		if (editbuf.changed < editbuf.scroll)
+			editbuf.changed = editbuf.scroll;
+		col = editbuf_cols(editbuf.scroll, editbuf.changed);
+		for (end = editbuf.changed, endcol = col; end < len && endcol < cols; end += n, endcol += w) {
+			n = editbuf_char(end, &cp);
+			w = editbuf_width(cp);
+			if (endcol + w > cols)
+				break;
+		}
+		if (editbuf.changed < end)
+			editbuf_draw(editbuf.changed, end, col);
+		if (endcol < cols) {
+			wmove(win_input, 0, (int)endcol);
+			wclrtoeol(win_input);
+		}
 	}
-	wmove(win_input, 0, editbuf.pos);
+	editbuf.changed = EDITBUF_CLEAN;
+
+	wmove(win_input, 0, (int)editbuf_cols(editbuf.scroll, editbuf.pos));
+}
+
+/* append formatted text to the banner buffer */
+static void banner_append (const char* fmt, ...) {
+	size_t len = strlen(banner);
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(banner + len, sizeof(banner) - len, fmt, va);
+	va_end(va);
 }
 
 /* paint banner */
 static void paint_banner (void) {
 	/* if autobanner is on, build our banner buffer */
 	if (autobanner) {
-		snprintf(banner, sizeof(banner), "%s:%s - (%s)", host, port, sock == -1 ? "disconnected" : "connected");
+		banner[0] = '\0';
+		banner_append("%s:%s - (%s", host, port,
+				conn_state == CONN_RESOLVING ? "resolving" :
+				conn_state == CONN_CONNECTING ? "connecting" :
+				sock == -1 ? "disconnected" : "connected");
+#ifdef HAVE_ZLIB
+		if (mccp.in_bytes != 0)
+			banner_append(", mccp %s %.1fx", mccp.active ? "on" : "off",
+					(double)mccp.out_bytes / mccp.in_bytes);
+#endif
+		if (sendq.len != 0)
+			banner_append(", %zu queued", sendq.len);
+		if (search.len != 0)
+			banner_append(", %s in %.1f ms",
+					search.pending ? "searching" :
+					search.match != SEARCH_NONE ? "found" : "not found",
+					search.busy * 1000);
+		if (scrollback.offset != 0)
+			banner_append(", back %zu/%zu lines, %zu KB", scrollback.offset,
+					scrollback.count,
+					(scrollback.chunks * sizeof(struct SCROLLCHUNK) +
+					 scrollback.max * sizeof(struct SCROLLLINE) +
+					 scrollback.text_size) / 1024);
+		banner_append(")");
 	}
 
-	/* paint */
-	wclear(win_banner);
-	mvwaddstr(win_banner, 0, 0, banner);
+	/* paint, if it changed */
+	if (strcmp(banner, banner_painted) != 0) {
+		wclear(win_banner);
+		mvwaddstr(win_banner, 0, 0, banner);
+		wnoutrefresh(win_banner);
+		strcpy(banner_painted, banner);
+	}
+}
+
+/* milliseconds until output may be repainted again */
+static int paint_delay (void) {
+	struct timespec now;
+	long elapsed;
+
+	if (max_fps <= 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - last_paint.tv_sec) * 1000 +
+			(now.tv_nsec - last_paint.tv_nsec) / 1000000;
+	if (elapsed >= 1000 / max_fps)
+		return 0;
+	return 1000 / max_fps - elapsed;
+}
+
+/* push dirty windows to the terminal; output windows wait for the frame
+ * deadline unless forced, win_input always goes last to own the cursor */
+static void refresh_display (int force) {
+	int due = (dirty & (DIRTY_MAIN | DIRTY_BANNER)) && (force || paint_delay() == 0);
+
+	if (!due && !(dirty & DIRTY_INPUT))
+		return;
+
+	if (due) {
+		if (dirty & DIRTY_MAIN)
+			wnoutrefresh(scrollback.offset != 0 ? win_scroll : win_main);
+		if (dirty & DIRTY_BANNER)
+			paint_banner();
+		clock_gettime(CLOCK_MONOTONIC, &last_paint);
+		dirty &= ~(DIRTY_MAIN | DIRTY_BANNER);
+	}
+
+	wnoutrefresh(win_input);
+	doupdate();
+	dirty &= ~DIRTY_INPUT;
 }
 
 /* redraw all windows */
@@ -261,577 +1201,5369 @@ static void redraw_display (void) {
 	mvwin(win_banner, LINES-2, 0);
 	wresize(win_banner, 1, COLS);
 	wresize(win_main, LINES-2, COLS);
-
-	/* update */
-	paint_banner();
+	wresize(win_scroll, LINES-2, COLS);
+	if (scrollback.offset != 0)
+		scrollback_render();
 
 	/* update size */
 	if (running)
 		send_naws();
 
 	/* input display */
+	editbuf.full = 1;
 	editbuf_display();
 
-	/* refresh */
-	wnoutrefresh(win_main);
-	wnoutrefresh(win_banner);
-	wnoutrefresh(win_input);
-	doupdate();
+	/* refresh everything */
+	banner_painted[0] = '\0';
+	dirty |= DIRTY_MAIN | DIRTY_BANNER;
+	refresh_display(1);
 }
 
-/* force-send bytes to server */
-static void do_send (const char* bytes, size_t len) {
-	int ret;
+/* write as much of the send queue as the socket will take */
+static void sendq_flush (void) {
+	struct iovec iov[2];
+	int iovcnt;
+	ssize_t ret;
+
+	while (sendq.len > 0) {
+		/* the ring holds at most two contiguous parts */
+		iov[0].iov_base = sendq.buf + sendq.head;
+		iov[0].iov_len = sendq.size - sendq.head;
+		iovcnt = 1;
+		if (iov[0].iov_len >= sendq.len) {
+			iov[0].iov_len = sendq.len;
+		} else {
+			iov[1].iov_base = sendq.buf;
+			iov[1].iov_len = sendq.len - iov[0].iov_len;
+			iovcnt = 2;
+		}
 
-	/* keep sending bytes until they're all sent */
-	while (len > 0) {
-		ret = send(sock, bytes, len, 0);
+		ret = writev(sock, iov, iovcnt);
 		if (ret == -1) {
-			if (ret != EAGAIN && ret != EINTR) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
 				endwin();
-				fprintf(stderr, "send() failed: %s\n", strerror(errno));
+				fprintf(stderr, "writev() failed: %s\n", strerror(errno));
 				exit(1);
 			}
-			continue;
-		} else if (ret == 0) {
-			endwin();
-			printf("Disconnected from server\n");
-			exit(0);
-		} else {
-			sent_bytes += ret;
-			bytes += ret;
-			len -= ret;
+			return;
 		}
+
+		++sent_writes;
+		sent_bytes += ret;
+		sendq.head = (sendq.head + ret) % sendq.size;
+		sendq.len -= ret;
+		dirty |= DIRTY_BANNER;
 	}
+
+	/* rewind an empty queue so the next write is contiguous */
+	sendq.head = 0;
 }
 
-/* process user input */
-static void on_key (int key) {
-	/* special keys */
-	if (key >= KEY_MIN && key <= KEY_MAX) {
-		/* send */
-		if (key == KEY_ENTER) {
-			/* send line to server */
-			send_line(editbuf.buf, editbuf.size);
-			/* reset input */
-			editbuf_set("");
-		}
+/* append bytes to the send queue, growing it as needed */
+static void sendq_push (const char* bytes, size_t len) {
+	size_t size;
+	size_t tail;
+	size_t chunk;
+	char* buf;
 
-		/* backspace/delete */
-		else if (key == KEY_BACKSPACE) {
-			editbuf_bs();
+	/* grow; unwrap the old contents to the start of the new buffer */
+	if (sendq.len + len > sendq.size) {
+		size = sendq.size ? sendq.size : SENDQ_MIN;
+		while (size < sendq.len + len)
+			size *= 2;
+
+		buf = (char*)malloc(size);
+		if (buf == NULL) {
+			endwin();
+			fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+			exit(1);
 		}
-		else if (key == KEY_DC) {
-			editbuf_del();
+
+		chunk = sendq.size - sendq.head;
+		if (chunk > sendq.len)
+			chunk = sendq.len;
+		if (sendq.len != 0) {
+			memcpy(buf, sendq.buf + sendq.head, chunk);
+			memcpy(buf + chunk, sendq.buf, sendq.len - chunk);
 		}
 
-		/* move cursor left/right */
-		else if (key == KEY_LEFT) {
-			editbuf_curleft();
-		}
-		else if (key == KEY_RIGHT) {
-			editbuf_curright();
-		}
-		else if (key == KEY_HOME) {
-			editbuf_home();
-		}
-		else if (key == KEY_END) {
-			editbuf_end();
+		free(sendq.buf);
+		sendq.buf = buf;
+		sendq.size = size;
+		sendq.head = 0;
+	}
+
+	/* copy in, wrapping around the end of the ring */
+	tail = (sendq.head + sendq.len) % sendq.size;
+	chunk = sendq.size - tail;
+	if (chunk > len)
+		chunk = len;
+	memcpy(sendq.buf + tail, bytes, chunk);
+	memcpy(sendq.buf, bytes + chunk, len - chunk);
+	sendq.len += len;
+}
+
+/* queue bytes for the server; the main loop sends them all at once at
+ * the end of the iteration */
+static void do_send (const char* bytes, size_t len) {
+	/* hold output until the connection is up; replays have no server
+	 * to talk to at all */
+	if (sock == -1) {
+		if (conn_state == CONN_RESOLVING || conn_state == CONN_CONNECTING)
+			sendq_push(bytes, len);
+		return;
+	}
+
+	if (capture != NULL)
+		capture_write(CAPTURE_SEND, bytes, len);
+
+	sendq_push(bytes, len);
+	dirty |= DIRTY_BANNER;
+}
+
+/* segments the kernel has sent on the socket, or -1 if unknown */
+static long send_segments (void) {
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	memset(&info, 0, sizeof(info));
+	if (sock != -1 && getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+			len >= offsetof(struct tcp_info, tcpi_data_segs_out) + sizeof(info.tcpi_data_segs_out))
+		return info.tcpi_data_segs_out;
+#endif
+	return -1;
+}
+
+/* pass received bytes to the telnet parser */
+static void do_recv (const char* bytes, size_t len) {
+#ifdef HAVE_ZLIB
+	mccp_recv(bytes, len);
+#else
+	telnet_recv(telnet, bytes, len);
+#endif
+}
+
+/* encode a LEB128 varint, returns the number of bytes used */
+static size_t varint_put (unsigned char* out, unsigned long long value) {
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		out[len++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	out[len++] = (unsigned char)value;
+	return len;
+}
+
+/* decode a LEB128 varint, returns 0 if it runs past the end */
+static size_t varint_get (const char* in, size_t len, unsigned long long* value) {
+	size_t i;
+
+	*value = 0;
+	for (i = 0; i != len && i < 10; ++i) {
+		*value |= (unsigned long long)((unsigned char)in[i] & 0x7f) << (7 * i);
+		if (!((unsigned char)in[i] & 0x80))
+			return i + 1;
+	}
+	return 0;
+}
+
+/* open a capture file */
+static void capture_open (const char* path) {
+	if ((capture = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	setvbuf(capture, NULL, _IOFBF, CAPTURE_BUFFER);
+	fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, capture);
+	capture_last = now_sec();
+}
+
+/* append a record to the capture file */
+static void capture_write (int dir, const char* bytes, size_t len) {
+	unsigned char head[21];
+	size_t hlen = 0;
+	double now = now_sec();
+
+	head[hlen++] = dir;
+	hlen += varint_put(head + hlen, (unsigned long long)((now - capture_last) * 1e6));
+	hlen += varint_put(head + hlen, len);
+	capture_last = now;
+
+	fwrite(head, 1, hlen, capture);
+	fwrite(bytes, 1, len, capture);
+}
+
+/* read everything the socket has ready */
+static void recv_drain (void) {
+	size_t burst = 0;
+	ssize_t ret;
+
+	/* stop at a sane limit so a flood can't starve the keyboard */
+	while (burst < RECV_BURST_MAX) {
+		ret = recv(sock, recvbuf, recvbuf_size, 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				endwin();
+				fprintf(stderr, "recv() failed: %s\n", strerror(errno));
+				exit(1);
+			}
+			break;
+		} else if (ret == 0) {
+			running = 0;
+			break;
 		}
 
-	/* regular text */
+		recv_bytes += ret;
+		burst += ret;
+		if (capture != NULL)
+			capture_write(CAPTURE_RECV, recvbuf, ret);
+		do_recv(recvbuf, ret);
+	}
+
+	/* connection state or compression stats may have changed */
+	dirty |= DIRTY_BANNER;
+
+	/* update statistics */
+	++recv_wakeups;
+	if (burst > recv_burst_max)
+		recv_burst_max = burst;
+}
+
+/* allocate the scrollback line ring */
+static void scrollback_init (size_t max) {
+	memset(&scrollback, 0, sizeof(scrollback));
+	scrollback.max = max;
+	scrollback.lines = (struct SCROLLLINE*)calloc(max, sizeof(struct SCROLLLINE));
+	if (scrollback.lines == NULL) {
+		fprintf(stderr, "calloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+/* release all scrollback memory */
+static void scrollback_free (void) {
+	struct SCROLLCHUNK* chunk;
+
+	while ((chunk = scrollback.free) != NULL) {
+		scrollback.free = chunk->next;
+		free(chunk);
+	}
+	while ((chunk = scrollback.chunk) != NULL) {
+		scrollback.chunk = chunk->next;
+		free(chunk);
+	}
+	free(scrollback.lines);
+	free(scrollback.text);
+}
+
+/* drop the oldest line, recycling its chunk if it held nothing else */
+static void scrollback_drop (void) {
+	struct SCROLLLINE* line = &scrollback.lines[scrollback.head];
+	struct SCROLLCHUNK** link;
+
+	scrollback.head = (scrollback.head + 1) % scrollback.max;
+	--scrollback.count;
+	scrollback.text_tail = line->text + line->bytes + 1;
+
+	if (--line->chunk->lines != 0 || line->chunk == scrollback.chunk)
+		return;
+
+	/* unlink from the in-use list, which runs newest to oldest */
+	for (link = &scrollback.chunk; *link != line->chunk; link = &(*link)->next)
+		;
+	*link = line->chunk->next;
+	line->chunk->next = scrollback.free;
+	scrollback.free = line->chunk;
+}
+
+/* make room for more line text; the live text is slid down to the start
+ * of the buffer, which doubles once the text fills more than half of it,
+ * so it always stays in one piece for the search to sweep */
+static void scrollback_text_reserve (size_t len) {
+	size_t live = scrollback.text_head - scrollback.text_tail;
+	size_t size = scrollback.text_size;
+	char* text;
+
+	if (scrollback.text_head + len - scrollback.text_base <= size)
+		return;
+
+	while (live + len > size / 2)
+		size = size != 0 ? size * 2 : SCROLL_TEXT_MIN;
+
+	if (size != scrollback.text_size) {
+		text = (char*)malloc(size);
+		if (text == NULL) {
+			endwin();
+			fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (live != 0)
+			memcpy(text, scrollback.text + (scrollback.text_tail - scrollback.text_base), live);
+		free(scrollback.text);
+		scrollback.text = text;
+		scrollback.text_size = size;
 	} else {
-		/* send */
-		if (key == '\n' || key == '\r') {
-			/* send line to server */
-			send_line(editbuf.buf, editbuf.size);
-			/* reset input */
-			editbuf_set("");
+		memmove(scrollback.text, scrollback.text + (scrollback.text_tail - scrollback.text_base), live);
+	}
+	scrollback.text_base = scrollback.text_tail;
+}
 
-		/* add key to edit buffer */
+/* move the current line into the arena */
+static void scrollback_commit (void) {
+	struct SCROLLCHUNK* chunk;
+	struct SCROLLLINE* line;
+	char* text;
+	size_t i;
+
+	if (scrollback.max == 0) {
+		scrollback.curlen = 0;
+		scrollback.curcols = 0;
+		return;
+	}
+	if (scrollback.count == scrollback.max)
+		scrollback_drop();
+
+	/* start a fresh chunk if the current one is full */
+	chunk = scrollback.chunk;
+	if (chunk == NULL || chunk->used + scrollback.curlen > SCROLL_CHUNK_CELLS) {
+		if (scrollback.free != NULL) {
+			chunk = scrollback.free;
+			scrollback.free = chunk->next;
 		} else {
-			editbuf_insert(key);
+			chunk = (struct SCROLLCHUNK*)malloc(sizeof(struct SCROLLCHUNK));
+			if (chunk == NULL) {
+				endwin();
+				fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+				exit(1);
+			}
+			++scrollback.chunks;
+		}
+		chunk->used = 0;
+		chunk->lines = 0;
+
+		/* a current chunk that already aged out goes straight to the free list */
+		if (scrollback.chunk != NULL && scrollback.chunk->lines == 0) {
+			chunk->next = scrollback.chunk->next;
+			scrollback.chunk->next = scrollback.free;
+			scrollback.free = scrollback.chunk;
+		} else {
+			chunk->next = scrollback.chunk;
 		}
+		scrollback.chunk = chunk;
 	}
 
-	/* draw input */
-	editbuf_display();
+	/* copy the cells */
+	line = &scrollback.lines[(scrollback.head + scrollback.count) % scrollback.max];
+	line->chunk = chunk;
+	line->cells = chunk->cells + chunk->used;
+	line->len = scrollback.curlen;
+	memcpy(line->cells, scrollback.cur, scrollback.curlen * sizeof(struct SCROLLCELL));
+	chunk->used += scrollback.curlen;
+	++chunk->lines;
+
+	/* and the plain text, re-encoded */
+	scrollback_text_reserve(scrollback.curlen * 4 + 1);
+	line->text = scrollback.text_head;
+	text = scrollback.text + (scrollback.text_head - scrollback.text_base);
+	for (i = 0; i != scrollback.curlen; ++i) {
+		if (scrollback.cur[i].ch < 0x80)
+			*text++ = (char)scrollback.cur[i].ch;
+		else
+			text += utf8_encode(scrollback.cur[i].ch, text);
+	}
+	*text = '\n';
+	line->bytes = text - (scrollback.text + (scrollback.text_head - scrollback.text_base));
+	scrollback.text_head += line->bytes + 1;
+	++scrollback.count;
+	scrollback.curlen = 0;
+	scrollback.curcols = 0;
+
+	/* keep a scrolled view anchored on the same text */
+	if (scrollback.offset != 0 && scrollback.offset < scrollback.count)
+		++scrollback.offset;
 }
 
-/* perform a terminal escape */
-static void on_term_esc(char cmd) {
+/* forget the newest line */
+static void scrollback_uncommit (void) {
+	struct SCROLLLINE* line;
+
+	if (scrollback.count == 0)
+		return;
+
+	/* the newest line always sits at the end of the current chunk */
+	line = &scrollback.lines[(scrollback.head + scrollback.count - 1) % scrollback.max];
+	line->chunk->used -= line->len;
+	--line->chunk->lines;
+	--scrollback.count;
+	scrollback.text_head = line->text;
+
+	if (scrollback.offset > 1)
+		--scrollback.offset;
+}
+
+/* replace the attributes of the newest line */
+static void scrollback_restyle (attr_t attr) {
+	struct SCROLLLINE* line;
 	size_t i;
 
-	switch (cmd) {
-		/* mode set: */
-		case 'm':
-			for (i = 0; i < terminal.esc_cnt; ++i) {
-				/* default */
-				if (terminal.esc_buf[i] == 0) {
-					terminal.color = TERM_COLOR_DEFAULT;
-					wattron(win_main, COLOR_PAIR(terminal.color));
-				}
-				/* color */
-				else if (terminal.esc_buf[i] >= 31 && terminal.esc_buf[i] <= 37) {
-					terminal.color = terminal.esc_buf[i] - 30;
-					wattron(win_main, COLOR_PAIR(terminal.color));
-				}
-			}
+	if (scrollback.count == 0)
+		return;
+
+	line = &scrollback.lines[(scrollback.head + scrollback.count - 1) % scrollback.max];
+	for (i = 0; i != line->len; ++i)
+		line->cells[i].attr = attr;
+}
+
+/* record ASCII text, with the current attributes, into the current line */
+static void scrollback_write (const char* text, size_t len) {
+	attr_t attr = getattrs(win_main);
+	struct SCROLLCELL* cell;
+	size_t i;
+
+	for (i = 0; i != len; ++i) {
+		/* overlong lines are split */
+		if (scrollback.curlen == SCROLL_LINE_MAX)
+			scrollback_commit();
+		cell = &scrollback.cur[scrollback.curlen++];
+		cell->ch = (unsigned char)text[i];
+		cell->attr = attr;
+		++scrollback.curcols;
+	}
+}
+
+/* record decoded characters; zero width ones are left out */
+static void scrollback_write_wide (const wchar_t* text, size_t len) {
+	attr_t attr = getattrs(win_main);
+	struct SCROLLCELL* cell;
+	size_t i;
+	int width;
+
+	for (i = 0; i != len; ++i) {
+		width = char_width(text[i]);
+		if (width == 0)
+			continue;
+		if (scrollback.curlen == SCROLL_LINE_MAX)
+			scrollback_commit();
+		cell = &scrollback.cur[scrollback.curlen++];
+		cell->ch = text[i];
+		cell->attr = attr;
+		scrollback.curcols += width;
+	}
+}
+
+/* record a control character */
+static void scrollback_control (char c) {
+	switch (c) {
+		case '\n':
+			scrollback_commit();
 			break;
-		/* clear */
-		case 'J':
-			/* clear whole screen */
-			if (terminal.esc_buf[0] == 2)
-				wclear(win_main);
+		case '\t':
+			do {
+				scrollback_write(" ", 1);
+			} while (scrollback.curcols % 8 != 0);
+			break;
+		case '\b':
+			if (scrollback.curlen != 0) {
+				--scrollback.curlen;
+				scrollback.curcols -= char_width(scrollback.cur[scrollback.curlen].ch);
+			}
 			break;
 	}
 }
 
-/* process text into virtual terminal, no ANSI */
-static void on_text_plain (const char* text, size_t len) {
+/* find where each row of a line wrapped at cols starts, the same way the
+ * live window wraps it: a wide character that would straddle the edge
+ * moves down whole; returns the number of rows */
+static int scrollback_wrap (const struct SCROLLLINE* line, int cols, size_t* starts) {
 	size_t i;
-	for (i = 0; i < len; ++i) {
-		/* don't send ESC codes, for safety */
-		if (text[i] != 27 && text[i] != '\r')
-			waddch(win_main, text[i]);
+	int rows = 1;
+	int col = 0;
+	int width;
+
+	starts[0] = 0;
+	for (i = 0; i != line->len; ++i) {
+		width = char_width(line->cells[i].ch);
+		if (col + width > cols && col != 0) {
+			starts[rows++] = i;
+			col = 0;
+		}
+		col += width;
 	}
+	starts[rows] = line->len;
+	return rows;
 }
 
-/* process text into virtual terminal */
-static void on_text_ansi (const char* text, size_t len) {
+/* draw the scrolled view; the newest line shown sits on the bottom row */
+static void scrollback_render (void) {
+	int rows = getmaxy(win_scroll);
+	int cols = getmaxx(win_scroll);
+	size_t n = scrollback.count - scrollback.offset + 1;
+	struct SCROLLLINE* line;
+	const struct SCROLLCELL* cells;
+	struct SCROLLCELL marked[SCROLL_LINE_MAX];
+	size_t starts[SCROLL_LINE_MAX + 2];
+	cchar_t row[SCROLL_LINE_MAX];
+	wchar_t wch[2] = { 0, 0 };
 	size_t i;
-	for (i = 0; i < len; ++i) {
-		switch (terminal.state) {
-			case TERM_ASCII:
-				/* begin escape sequence */
-				if (text[i] == 27)
-					terminal.state = TERM_ESC;
-				/* just show it */
-				else if (text[i] != '\r')
-					waddch(win_main, text[i]);
-				break;
-			case TERM_ESC:
-				/* run of mod setting commands */
-				if (text[i] == '[') {
-					terminal.state = TERM_ESCRUN;
-					terminal.esc_cnt = 0;
-					terminal.esc_buf[0] = 0;
-				}
-				/* something else we don't support */
-				else
-					terminal.state = TERM_ASCII;
-				break;
-			case TERM_ESCRUN:
-				/* number, add to option */
-				if (isdigit(text[i])) {
-					if (terminal.esc_cnt == 0)
-						terminal.esc_cnt = 1;
-					terminal.esc_buf[terminal.esc_cnt-1] *= 10;
-					terminal.esc_buf[terminal.esc_cnt-1] += text[i] - '0';
-				}
-				/* semi-colon, go to next option */
-				else if (text[i] == ';') {
-					if (terminal.esc_cnt < TERM_MAX_ESC) {
-						terminal.esc_cnt++;
-						terminal.esc_buf[terminal.esc_cnt-1] = 0;
-					}
-				}
-				/* anything-else; perform option */
-				else {
-					on_term_esc(text[i]);
-					terminal.state = TERM_ASCII;
-				}
-				break;
+	int height;
+	int top;
+	int r;
+
+	werase(win_scroll);
+	paircache_forget();
+	while (rows > 0 && n-- > 0) {
+		line = &scrollback.lines[(scrollback.head + n) % scrollback.max];
+		cells = search.len != 0 ? search_mark(line, marked) : line->cells;
+
+		height = scrollback_wrap(line, cols, starts);
+		top = rows - height;
+		for (r = 0; r != height; ++r) {
+			if (top + r < 0)
+				continue;
+			for (i = starts[r]; i != starts[r + 1]; ++i) {
+				wch[0] = cells[i].ch;
+				setcchar(&row[i - starts[r]], wch, cells[i].attr & ~A_COLOR,
+						PAIR_NUMBER(cells[i].attr), NULL);
+			}
+			mvwadd_wchnstr(win_scroll, top + r, 0, row, (int)(starts[r + 1] - starts[r]));
 		}
+		rows = top;
 	}
+	dirty |= DIRTY_MAIN | DIRTY_BANNER;
 }
 
-/* attempt to connect to the requested hostname on the request port */
-static int do_connect (const char* host, const char* port) {
-	struct addrinfo hints;
-	struct addrinfo *results;
-	struct addrinfo *ai;
-	int ret;
-	int sock;
+/* show the view with the given line offset from the bottom, 0 being live */
+static void scrollback_goto (size_t offset) {
+	if (offset == scrollback.offset)
+		return;
+	scrollback.offset = offset;
 
-	/* lookup host */
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	/* back to live output, which also drops finished search highlights */
+	if (offset == 0) {
+		if (!search.active)
+			search.len = 0;
+		touchwin(win_main);
+		dirty |= DIRTY_MAIN | DIRTY_BANNER;
+		return;
+	}
 
-	if ((ret = getaddrinfo(host, port, &hints, &results)) != 0) {
-		fprintf(stderr, "Host lookup failed: %s\n", gai_strerror(ret));
-		return -1;
+	scrollback_render();
+}
+
+/* scroll back (positive) or forward (negative) by some lines */
+static void scrollback_page (int lines) {
+	size_t offset = scrollback.offset;
+
+	if (lines > 0) {
+		offset += lines;
+		if (offset > scrollback.count)
+			offset = scrollback.count;
+	} else {
+		offset = (size_t)-lines >= offset ? 0 : offset + lines;
 	}
 
-	/* loop through hosts, trying to connect */
-	for (ai = results; ai != NULL; ai = ai->ai_next) {
-		/* create socket */
-		sock = socket(AF_INET, SOCK_STREAM, 0);
-		if (sock == -1) {
-			fprintf(stderr, "socket() failed: %s\n", strerror(errno));
-			exit(1);
-		}
+	scrollback_goto(offset);
+}
 
-		/* connect */
-		if (connect(sock, ai->ai_addr, ai->ai_addrlen) != -1) {
-			freeaddrinfo(results);
-			return sock;
-		}
+/* read a whole file into memory */
+static char* load_file (const char* path, size_t* size) {
+	FILE* file;
+	char* data;
+	long len;
+
+	if ((file = fopen(path, "rb")) == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
 
-		/* release socket */
-		shutdown(sock, SHUT_RDWR);
+	fseek(file, 0, SEEK_END);
+	len = ftell(file);
+	rewind(file);
+
+	data = (char*)malloc(len > 0 ? len : 1);
+	if (data == NULL || fread(data, 1, len, file) != (size_t)len) {
+		fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+		exit(1);
 	}
+	fclose(file);
 
-	/* could not connect */
-	freeaddrinfo(results);
-	return -1;
+	*size = len;
+	return data;
 }
 
-int main (int argc, char** argv) {
-	const char* default_port = "23";
-	struct sigaction sa;
-	int i;
+/* load a replay, noting whether it is a capture or raw server output */
+static void replay_open (const char* path) {
+	replay.data = load_file(path, &replay.size);
+	if (replay.size >= CAPTURE_MAGIC_LEN &&
+			memcmp(replay.data, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) == 0) {
+		replay.capture = 1;
+		replay.off = CAPTURE_MAGIC_LEN;
+	}
+	replay.start = now_sec();
+}
 
-	/* process command line args */
-	for (i = 1; i < argc; ++i) {
-		/* help */
-		if (strcmp(argv[i], "-h") == 0) {
-			printf(
-				"CLC %s by Sean Middleditch <elanthis@sourcemud.org>\n"
-				"This program has been released into the PUBLIC DOMAIN.\n\n"
-				"Usage:\n"
-				"  clc [-h] <host> [<port>]\n\n"
-				"Options:\n"
-				"  -h   display help\n", CLC_VERSION
-			);
-			return 0;
+/* milliseconds until the next replayed record is due, or -1 */
+static int replay_delay (void) {
+	unsigned long long delta;
+	double due;
+
+	if (replay.data == NULL || !replay.realtime || replay.off == replay.size)
+		return -1;
+
+	if (varint_get(replay.data + replay.off + 1, replay.size - replay.off - 1, &delta) == 0)
+		return 0;
+	due = replay.start + replay.clock + delta / 1e6 - now_sec();
+	return due > 0 ? (int)(due * 1000) + 1 : 0;
+}
+
+/* feed recorded server output through the same path recv_drain uses;
+ * raw files go one receive buffer at a time, captures one recorded
+ * recv() at a time */
+static void replay_step (void) {
+	unsigned long long delta;
+	unsigned long long len;
+	const char* data;
+	size_t chunk;
+	size_t used;
+	double start;
+	double mid;
+
+	while (replay.off != replay.size) {
+		if (replay.capture) {
+			/* stop until the record is due */
+			if (replay_delay() > 0)
+				break;
+
+			/* decode record header; a truncated capture just ends */
+			used = 1;
+			chunk = varint_get(replay.data + replay.off + used, replay.size - replay.off - used, &delta);
+			used += chunk;
+			if (chunk != 0)
+				used += chunk = varint_get(replay.data + replay.off + used, replay.size - replay.off - used, &len);
+			if (chunk == 0 || len > replay.size - replay.off - used) {
+				replay.off = replay.size;
+				break;
+			}
+
+			data = replay.data + replay.off + used;
+			replay.clock += delta / 1e6;
+			replay.off += used + len;
+
+			/* only server output is fed back */
+			if (replay.data[replay.off - used - len] != CAPTURE_RECV)
+				continue;
+			chunk = len;
+		} else {
+			data = replay.data + replay.off;
+			chunk = replay.size - replay.off < recvbuf_size ? replay.size - replay.off : recvbuf_size;
+			replay.off += chunk;
 		}
 
-		/* other unknown option */
-		if (argv[i][0] == '-') {
-			fprintf(stderr, "Unknown option %s.\nUse -h to see available options.\n", argv[i]);
-			exit(1);
+		start = now_sec();
+		do_recv(data, chunk);
+		mid = now_sec();
+		refresh_display(!replay.realtime);
+
+		bench.telnet += mid - start;
+		bench.refresh += now_sec() - mid;
+		recv_bytes += chunk;
+		++recv_wakeups;
+	}
+
+	/* release the data once it has all been shown */
+	if (replay.off == replay.size) {
+		free(replay.data);
+		replay.data = NULL;
+	}
+}
+
+/* print benchmark results */
+static void bench_report (double total) {
+	double mb = recv_bytes / 1e6;
+
+	printf("replay: %zu bytes in %zu chunks, %zu telnet events\n", recv_bytes,
+			recv_wakeups, bench.events);
+	printf("total:   %8.3f s  %8.2f MB/s  %10.0f events/s\n", total,
+			mb / total, bench.events / total);
+	printf("telnet:  %8.3f s  %8.2f MB/s\n", bench.telnet - bench.render - bench.charset,
+			mb / (bench.telnet - bench.render - bench.charset));
+	printf("render:  %8.3f s  %8.2f MB/s\n", bench.render, mb / bench.render);
+	if (charset.current->legacy)
+		printf("charset: %8.3f s  %8.2f MB/s  (%s)\n", bench.charset,
+				mb / bench.charset, charset.current->name);
+	printf("refresh: %8.3f s  %8.2f MB/s\n", bench.refresh, mb / bench.refresh);
+}
+
+/* time each printable run scanner, hopping from run to run over a file,
+ * then each finder, sweeping the file for a word it doesn't hold, then
+ * each legacy charset decoder */
+static void bench_scan (const char* path) {
+	const struct CHARSET* current = charset.current;
+	const struct CHARSET* cs;
+	struct SCANNER* s;
+	size_t i, size, passes, chunk, len;
+	double start, elapsed;
+	char* data;
+
+	data = load_file(path, &size);
+	for (s = scanners; s->name != NULL; ++s) {
+		if (!s->usable) {
+			printf("scan %-6s unsupported\n", s->name);
+			continue;
 		}
+		passes = 0;
+		start = now_sec();
+		do {
+			for (i = 0; i < size; i += s->scan(data + i, size - i) + 1)
+				;
+			++passes;
+			elapsed = now_sec() - start;
+		} while (elapsed < 0.25);
+		printf("scan %-6s %8.2f MB/s%s\n", s->name,
+				size * passes / elapsed / 1e6,
+				s->scan == term_run_length ? "  (selected)" : "");
+	}
+	for (s = scanners; s->name != NULL; ++s) {
+		if (!s->usable)
+			continue;
+		passes = 0;
+		start = now_sec();
+		do {
+			s->find(data, size, "tells you\x01", 10);
+			++passes;
+			elapsed = now_sec() - start;
+		} while (elapsed < 0.25);
+		printf("find %-6s %8.2f MB/s%s\n", s->name,
+				size * passes / elapsed / 1e6,
+				s->find == search_find ? "  (selected)" : "");
+	}
 
-		/* if host is unset, this is the host */
-		if (host == NULL) {
-			host = argv[i];
-		/* otherwise, it's a port */
-		} else {
-			port = argv[i];
+	/* and each legacy charset, a receive buffer at a time */
+	for (cs = charsets; cs->name != NULL; ++cs) {
+		if (!cs->legacy)
+			continue;
+		charset_select(cs);
+		passes = 0;
+		start = now_sec();
+		do {
+			for (i = 0; i < size; i += chunk) {
+				chunk = size - i < recvbuf_size ? size - i : recvbuf_size;
+				len = chunk;
+				charset_decode(data + i, &len);
+			}
+			++passes;
+			elapsed = now_sec() - start;
+		} while (elapsed < 0.25);
+		printf("charset %-10s %8.2f MB/s%s\n", cs->name,
+				size * passes / elapsed / 1e6,
+				cs == current ? "  (selected)" : "");
+	}
+	charset_select(current);
+	free(data);
+}
+
+/* process user input */
+static void on_key (int key) {
+	/* the search prompts take most keys while they are open */
+	if (search.active && search_key(key)) {
+		editbuf_display();
+		return;
+	}
+	if (history.searching && history_key(key)) {
+		editbuf_display();
+		return;
+	}
+
+	/* special keys */
+	if (key >= KEY_MIN && key <= KEY_MAX) {
+		/* send */
+		if (key == KEY_ENTER) {
+			/* send line to server */
+			size_t len;
+			const char* line = editbuf_text(&len);
+			history_add(line, len);
+			do_input(line, len);
+			/* reset input */
+			editbuf_set("");
+		}
+
+		/* backspace/delete */
+		else if (key == KEY_BACKSPACE) {
+			editbuf_bs();
+		}
+		else if (key == KEY_DC) {
+			editbuf_del();
+		}
+
+		/* move cursor left/right */
+		else if (key == KEY_LEFT) {
+			editbuf_curleft();
+		}
+		else if (key == KEY_RIGHT) {
+			editbuf_curright();
+		}
+		else if (key == KEY_HOME) {
+			editbuf_home();
+		}
+		else if (key == KEY_END) {
+			editbuf_end();
+		}
+
+		/* recall history */
+		else if (key == KEY_UP) {
+			history_prev();
+		}
+		else if (key == KEY_DOWN) {
+			history_next();
+		}
+
+		/* page through scrollback */
+		else if (key == KEY_PPAGE) {
+			scrollback_page(getmaxy(win_main) - 1);
+		}
+		else if (key == KEY_NPAGE) {
+			scrollback_page(-(getmaxy(win_main) - 1));
+		}
+
+	/* regular text */
+	} else {
+		/* send */
+		if (key == '\n' || key == '\r') {
+			/* send line to server */
+			size_t len;
+			const char* line = editbuf_text(&len);
+			history_add(line, len);
+			do_input(line, len);
+			/* reset input */
+			editbuf_set("");
+
+		/* terminals that send DEL or ^H for backspace */
+		} else if (key == 0x7f || key == '\b') {
+			editbuf_bs();
+
+		/* search scrollback */
+		} else if (key == CTRL_KEY('F')) {
+			search_start();
+
+		/* search history */
+		} else if (key == CTRL_KEY('R')) {
+			history_search_start();
+
+		/* add key to edit buffer */
+		} else {
+			editbuf_insert(key);
+		}
+	}
+
+	/* draw input */
+	editbuf_display();
+}
+
+/* rgb values of the 16 basic colors, as xterm draws them */
+static const unsigned char term_rgb16[16][3] = {
+	{ 0, 0, 0 }, { 205, 0, 0 }, { 0, 205, 0 }, { 205, 205, 0 },
+	{ 0, 0, 238 }, { 205, 0, 205 }, { 0, 205, 205 }, { 229, 229, 229 },
+	{ 127, 127, 127 }, { 255, 0, 0 }, { 0, 255, 0 }, { 255, 255, 0 },
+	{ 92, 92, 255 }, { 255, 0, 255 }, { 0, 255, 255 }, { 255, 255, 255 }
+};
+
+/* levels of the 6x6x6 color cube in the 256 color palette */
+static const unsigned char term_cube[6] = { 0, 95, 135, 175, 215, 255 };
+
+/* rgb values of a 256 color palette entry */
+static void term_rgb256 (int color, int* r, int* g, int* b) {
+	if (color < 16) {
+		*r = term_rgb16[color][0];
+		*g = term_rgb16[color][1];
+		*b = term_rgb16[color][2];
+	} else if (color < 232) {
+		*r = term_cube[(color - 16) / 36];
+		*g = term_cube[(color - 16) / 6 % 6];
+		*b = term_cube[(color - 16) % 6];
+	} else {
+		*r = *g = *b = 8 + (color - 232) * 10;
+	}
+}
+
+/* squared distance between two colors */
+static int term_rgb_dist (int r1, int g1, int b1, int r2, int g2, int b2) {
+	return (r1 - r2) * (r1 - r2) + (g1 - g2) * (g1 - g2) + (b1 - b2) * (b1 - b2);
+}
+
+/* nearest 256 color palette entry to an rgb value */
+static int term_rgb_to256 (int r, int g, int b) {
+	int ri, gi, bi;
+	int gray;
+	int cr, cg, cb;
+
+	/* nearest cube level per channel */
+	for (ri = 5; ri > 0 && term_cube[ri] - (term_cube[ri] - term_cube[ri - 1]) / 2 > r; --ri)
+		;
+	for (gi = 5; gi > 0 && term_cube[gi] - (term_cube[gi] - term_cube[gi - 1]) / 2 > g; --gi)
+		;
+	for (bi = 5; bi > 0 && term_cube[bi] - (term_cube[bi] - term_cube[bi - 1]) / 2 > b; --bi)
+		;
+
+	/* nearest gray, which may be closer for desaturated colors */
+	gray = ((r + g + b) / 3 - 3) / 10;
+	if (gray < 0)
+		gray = 0;
+	else if (gray > 23)
+		gray = 23;
+
+	term_rgb256(16 + ri * 36 + gi * 6 + bi, &cr, &cg, &cb);
+	if (term_rgb_dist(r, g, b, 8 + gray * 10, 8 + gray * 10, 8 + gray * 10) <
+			term_rgb_dist(r, g, b, cr, cg, cb))
+		return 232 + gray;
+	return 16 + ri * 36 + gi * 6 + bi;
+}
+
+/* set up the color pair cache for this terminal */
+static void paircache_init (void) {
+	int r, g, b;
+	int best;
+	int i, j;
+
+	memset(&paircache, 0, sizeof(paircache));
+	memset(paircache.buckets, -1, sizeof(paircache.buckets));
+	paircache.head = paircache.tail = -1;
+	paircache.limit = COLOR_PAIRS < PAIR_MAX ? COLOR_PAIRS : PAIR_MAX;
+
+	/* nearest basic color for every palette entry */
+	for (i = 0; i != 256; ++i) {
+		term_rgb256(i, &r, &g, &b);
+		for (best = 0, j = 1; j != 16; ++j)
+			if (term_rgb_dist(r, g, b, term_rgb16[j][0], term_rgb16[j][1], term_rgb16[j][2]) <
+					term_rgb_dist(r, g, b, term_rgb16[best][0], term_rgb16[best][1], term_rgb16[best][2]))
+				best = j;
+		paircache.to16[i] = i < 16 ? i : best;
+	}
+}
+
+/* unlink a pair from the LRU list */
+static void paircache_unlink (short pair) {
+	struct COLORPAIR* p = &paircache.pairs[pair];
+
+	if (p->prev != -1)
+		paircache.pairs[p->prev].next = p->next;
+	else
+		paircache.head = p->next;
+	if (p->next != -1)
+		paircache.pairs[p->next].prev = p->prev;
+	else
+		paircache.tail = p->prev;
+}
+
+/* link a pair at the most recently used end of the LRU list */
+static void paircache_front (short pair) {
+	struct COLORPAIR* p = &paircache.pairs[pair];
+
+	p->prev = -1;
+	p->next = paircache.head;
+	if (paircache.head != -1)
+		paircache.pairs[paircache.head].prev = pair;
+	paircache.head = pair;
+	if (paircache.tail == -1)
+		paircache.tail = pair;
+}
+
+/* mark the pairs used by the cells of a window */
+static void paircache_mark (WINDOW* win, unsigned char* used) {
+	wchar_t wch[CCHARW_MAX + 1];
+	cchar_t cell;
+	attr_t attr;
+	short pair;
+	int rows = getmaxy(win);
+	int cols = getmaxx(win);
+	int y, x;
+	int cy, cx;
+
+	getyx(win, cy, cx);
+	for (y = 0; y != rows; ++y) {
+		for (x = 0; x != cols; ++x) {
+			if (mvwin_wch(win, y, x, &cell) == OK &&
+					getcchar(&cell, wch, &attr, &pair, NULL) == OK &&
+					pair >= 0 && pair < PAIR_MAX)
+				used[pair] = 1;
+		}
+	}
+	wmove(win, cy, cx);
+}
+
+/* the screen was redrawn from elsewhere, so no pair is known to be off it */
+static void paircache_forget (void) {
+	memset(paircache.spare, 0, sizeof(paircache.spare));
+}
+
+/* the least recently used pair that nothing on screen shows, or the
+ * least recently used of all when every one is showing */
+static short paircache_victim (void) {
+	unsigned char used[PAIR_MAX];
+	short pair;
+
+	for (pair = paircache.tail; pair != -1; pair = paircache.pairs[pair].prev)
+		if (paircache.spare[pair])
+			return pair;
+
+	/* none left from the last look at the screen, so look again */
+	memset(used, 0, sizeof(used));
+	paircache_mark(win_main, used);
+	if (scrollback.offset != 0)
+		paircache_mark(win_scroll, used);
+	for (pair = paircache.tail; pair != -1; pair = paircache.pairs[pair].prev)
+		paircache.spare[pair] = !used[pair];
+
+	for (pair = paircache.tail; pair != -1; pair = paircache.pairs[pair].prev)
+		if (paircache.spare[pair])
+			return pair;
+	return paircache.tail;
+}
+
+/* find or allocate the pair for a curses fg/bg combination */
+static short paircache_get (short fg, short bg) {
+	unsigned int hash = ((unsigned int)(fg + 1) * 31 + (unsigned int)(bg + 1)) % PAIR_BUCKETS;
+	struct COLORPAIR* p;
+	short* link;
+	short pair;
+
+	/* the default colors are always pair 0 */
+	if (fg == -1 && bg == -1)
+		return 0;
+
+	for (pair = paircache.buckets[hash]; pair != -1; pair = paircache.pairs[pair].hnext) {
+		p = &paircache.pairs[pair];
+		if (p->fg == fg && p->bg == bg) {
+			++paircache.hits;
+			paircache.spare[pair] = 0;
+			if (paircache.head != pair) {
+				paircache_unlink(pair);
+				paircache_front(pair);
+			}
+			return pair;
+		}
+	}
+	++paircache.misses;
+
+	/* hand out a fresh pair, or recycle the least recently used one that
+	 * is off screen */
+	if (PAIR_FIRST + paircache.count < paircache.limit) {
+		pair = PAIR_FIRST + paircache.count++;
+	} else if (paircache.tail != -1) {
+		pair = paircache_victim();
+		p = &paircache.pairs[pair];
+		for (link = &paircache.buckets[((unsigned int)(p->fg + 1) * 31 + (unsigned int)(p->bg + 1)) % PAIR_BUCKETS];
+				*link != pair; link = &paircache.pairs[*link].hnext)
+			;
+		*link = p->hnext;
+		paircache_unlink(pair);
+		++paircache.evictions;
+	} else {
+		/* no pairs to spare at all */
+		return 0;
+	}
+
+	p = &paircache.pairs[pair];
+	p->fg = fg;
+	p->bg = bg;
+	p->hnext = paircache.buckets[hash];
+	paircache.buckets[hash] = pair;
+	paircache.spare[pair] = 0;
+	paircache_front(pair);
+	init_pair(pair, fg, bg);
+	return pair;
+}
+
+/* map an SGR color onto what the terminal can show; bright colors on
+ * 8 color terminals set bright instead */
+static short term_color (int color, int* bright) {
+	if (color == TERM_COLOR_NONE || COLORS == 0)
+		return -1;
+
+	if (color & TERM_RGB)
+		color = term_rgb_to256((color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+	if (color < COLORS)
+		return color;
+
+	color = paircache.to16[color];
+	if (color >= 8 && color >= COLORS) {
+		*bright = 1;
+		color -= 8;
+	}
+	return color;
+}
+
+/* apply the current SGR state to the main window */
+static void term_apply (void) {
+	attr_t attrs = terminal.attrs;
+	int bright = 0;
+	short fg = term_color(terminal.fg, &bright);
+	short bg;
+
+	if (bright)
+		attrs |= A_BOLD;
+	bg = term_color(terminal.bg, &bright);
+	wattrset(win_main, attrs | COLOR_PAIR(paircache_get(fg, bg)));
+}
+
+/* parse an extended 38/48 color; returns parameters used */
+static size_t term_sgr_color (size_t i, int* color) {
+	int* p = terminal.esc_buf;
+
+	if (i + 2 < terminal.esc_cnt && p[i + 1] == 5) {
+		*color = p[i + 2] & 0xff;
+		return 2;
+	}
+	if (i + 4 < terminal.esc_cnt && p[i + 1] == 2) {
+		*color = TERM_RGB | (p[i + 2] & 0xff) << 16 | (p[i + 3] & 0xff) << 8 | (p[i + 4] & 0xff);
+		return 4;
+	}
+	return terminal.esc_cnt - i - 1;
+}
+
+/* perform an SGR (select graphic rendition) sequence */
+static void term_sgr (void) {
+	size_t i;
+	int code;
+
+	/* an empty sequence is a reset */
+	if (terminal.esc_cnt == 0) {
+		terminal.fg = terminal.bg = TERM_COLOR_NONE;
+		terminal.attrs = A_NORMAL;
+	}
+
+	for (i = 0; i < terminal.esc_cnt; ++i) {
+		code = terminal.esc_buf[i];
+		switch (code) {
+			case 0:
+				terminal.fg = terminal.bg = TERM_COLOR_NONE;
+				terminal.attrs = A_NORMAL;
+				break;
+			case 1: terminal.attrs |= A_BOLD; break;
+			case 2: terminal.attrs |= A_DIM; break;
+			case 3: terminal.attrs |= A_ITALIC; break;
+			case 4: terminal.attrs |= A_UNDERLINE; break;
+			case 5: case 6: terminal.attrs |= A_BLINK; break;
+			case 7: terminal.attrs |= A_REVERSE; break;
+			case 8: terminal.attrs |= A_INVIS; break;
+			case 22: terminal.attrs &= ~(A_BOLD | A_DIM); break;
+			case 23: terminal.attrs &= ~A_ITALIC; break;
+			case 24: terminal.attrs &= ~A_UNDERLINE; break;
+			case 25: terminal.attrs &= ~A_BLINK; break;
+			case 27: terminal.attrs &= ~A_REVERSE; break;
+			case 28: terminal.attrs &= ~A_INVIS; break;
+			case 38: i += term_sgr_color(i, &terminal.fg); break;
+			case 39: terminal.fg = TERM_COLOR_NONE; break;
+			case 48: i += term_sgr_color(i, &terminal.bg); break;
+			case 49: terminal.bg = TERM_COLOR_NONE; break;
+			default:
+				if (code >= 30 && code <= 37)
+					terminal.fg = code - 30;
+				else if (code >= 40 && code <= 47)
+					terminal.bg = code - 40;
+				else if (code >= 90 && code <= 97)
+					terminal.fg = code - 90 + 8;
+				else if (code >= 100 && code <= 107)
+					terminal.bg = code - 100 + 8;
+				break;
+		}
+	}
+
+	term_apply();
+}
+
+/* perform a terminal escape */
+static void on_term_esc(char cmd) {
+	switch (cmd) {
+		/* mode set: */
+		case 'm':
+			term_sgr();
+			break;
+		/* clear */
+		case 'J':
+			/* clear whole screen */
+			if (terminal.esc_buf[0] == 2)
+				wclear(win_main);
+			break;
+	}
+}
+
+/* write decoded characters to the main window and scrollback */
+static void term_write_wide (const wchar_t* text, size_t len) {
+	waddnwstr(win_main, text, (int)len);
+	scrollback_write_wide(text, len);
+}
+
+/* write printable text to the main window and scrollback, returning the
+ * columns it takes; ASCII goes straight out, the rest is decoded as
+ * UTF-8, carrying an unfinished sequence over to the next call, and is
+ * sent a batch of characters at a time */
+static size_t term_write (const char* text, size_t len) {
+	wchar_t batch[UTF8_BATCH];
+	size_t cols = 0;
+	size_t i = 0;
+	size_t n;
+	unsigned int cp;
+
+	while (i < len) {
+		if (terminal.utf8_left == 0) {
+			n = utf8_ascii_length(text + i, len - i);
+			if (n != 0) {
+				waddnstr(win_main, text + i, n);
+				scrollback_write(text + i, n);
+				cols += n;
+				i += n;
+				continue;
+			}
+		}
+
+		/* decode up to the next ASCII byte; C1 controls are dropped */
+		n = 0;
+		while (i < len && n != UTF8_BATCH &&
+				(terminal.utf8_left != 0 || (unsigned char)text[i] >= 0x80)) {
+			i += utf8_decode(text + i, len - i, &cp);
+			if (cp == UTF8_NONE || cp < 0xa0)
+				continue;
+			batch[n++] = cp;
+			cols += char_width(cp);
+		}
+		if (n != 0)
+			term_write_wide(batch, n);
+	}
+	return cols;
+}
+
+/* a sequence cut short by a control byte or an escape is malformed;
+ * returns the columns of the replacement written for it */
+static size_t term_utf8_abort (void) {
+	wchar_t bad = UTF8_REPLACEMENT;
+
+	terminal.utf8_left = 0;
+	term_write_wide(&bad, 1);
+	return char_width(UTF8_REPLACEMENT);
+}
+
+/* write a control character to the main window and scrollback */
+static void term_control (char c) {
+	waddch(win_main, c);
+	scrollback_control(c);
+}
+
+/* collect printable server text, cols wide, into the current line */
+static void textline_write (const char* text, size_t len, size_t cols) {
+	if (triggers.count == 0 && !sessionlog.active)
+		return;
+
+	textline.cols += cols;
+	if (len > TEXTLINE_MAX - textline.len)
+		len = TEXTLINE_MAX - textline.len;
+	memcpy(textline.buf + textline.len, text, len);
+	textline.len += len;
+}
+
+/* collect a server control character; newlines finish the line */
+static void textline_control (char c) {
+	if (triggers.count == 0 && !sessionlog.active)
+		return;
+
+	switch (c) {
+		case '\n':
+			textline.buf[textline.len] = '\0';
+			if (sessionlog.active)
+				log_line(textline.buf, textline.len);
+			if (triggers.count != 0)
+				trigger_line();
+			textline.len = 0;
+			textline.cols = 0;
+			break;
+		case '\t':
+			textline.cols += 8 - textline.cols % 8;
+			if (textline.len != TEXTLINE_MAX)
+				textline.buf[textline.len++] = c;
+			break;
+		case '\b':
+			if (textline.cols != 0)
+				--textline.cols;
+			if (textline.len != 0)
+				--textline.len;
+			break;
+	}
+}
+
+/* process text into virtual terminal, no ANSI */
+static void on_text_plain (const char* text, size_t len) {
+	unsigned int utf8_cp = terminal.utf8_cp;
+	unsigned int utf8_min = terminal.utf8_min;
+	int utf8_left = terminal.utf8_left;
+	size_t i = 0;
+	size_t run;
+
+	/* this is only ever local text, which must neither finish nor break a
+	 * sequence the server left unfinished, so it decodes from a clean
+	 * state and the server's is put back after */
+	terminal.utf8_left = 0;
+
+	dirty |= DIRTY_MAIN;
+	while (i < len) {
+		/* emit whole runs of printable text at once */
+		run = term_run_length(text + i, len - i);
+		if (run != 0) {
+			term_write(text + i, run);
+			i += run;
+			continue;
+		}
+
+		if (terminal.utf8_left != 0)
+			term_utf8_abort();
+
+		/* don't send ESC codes, for safety */
+		if (text[i] != 27 && text[i] != '\r')
+			term_control(text[i]);
+		++i;
+	}
+	if (terminal.utf8_left != 0)
+		term_utf8_abort();
+
+	terminal.utf8_cp = utf8_cp;
+	terminal.utf8_min = utf8_min;
+	terminal.utf8_left = utf8_left;
+}
+
+/* display a warning message */
+static void on_warning (const char* msg) {
+	wattrset(win_main, COLOR_PAIR(COLOR_RED));
+	on_text_plain("\nWARNING:", 8);
+	on_text_plain(msg, strlen(msg));
+	on_text_plain("\n", 1);
+	term_apply();
+}
+
+/* display a client message */
+static void on_info (const char* fmt, ...) {
+	char buf[256];
+	va_list va;
+	int len;
+
+	va_start(va, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	wattrset(win_main, COLOR_PAIR(COLOR_CYAN));
+	on_text_plain(buf, len);
+	on_text_plain("\n", 1);
+	term_apply();
+}
+
+/* set the transition for a range of bytes in one state */
+static void term_rule (term_state_t state, int first, int last,
+		term_action_t action, term_state_t next) {
+	int c;
+
+	for (c = first; c <= last; ++c)
+		term_table[state][c] = (unsigned char)(action << 4 | next);
+}
+
+/* C0 controls other than CAN, SUB and ESC */
+static void term_rule_c0 (term_state_t state, term_action_t action) {
+	term_rule(state, 0x00, 0x17, action, state);
+	term_rule(state, 0x19, 0x19, action, state);
+	term_rule(state, 0x1c, 0x1f, action, state);
+}
+
+/* build the parser transition table */
+static void term_init (void) {
+	int s;
+
+	/* by default every byte is ignored without changing state */
+	for (s = 0; s != TERM_STATES; ++s)
+		term_rule(s, 0x00, 0xff, TERM_ACT_NONE, s);
+
+	/* ground; printable runs never reach the table */
+	term_rule_c0(TERM_GROUND, TERM_ACT_EXECUTE);
+
+	/* escape */
+	term_rule_c0(TERM_ESCAPE, TERM_ACT_EXECUTE);
+	term_rule(TERM_ESCAPE, 0x20, 0x2f, TERM_ACT_COLLECT, TERM_ESCAPE_INTER);
+	term_rule(TERM_ESCAPE, 0x30, 0x7e, TERM_ACT_ESC_DISPATCH, TERM_GROUND);
+	term_rule(TERM_ESCAPE, '[', '[', TERM_ACT_CLEAR, TERM_CSI_ENTRY);
+	term_rule(TERM_ESCAPE, ']', ']', TERM_ACT_NONE, TERM_OSC_STRING);
+	term_rule(TERM_ESCAPE, 'P', 'P', TERM_ACT_NONE, TERM_SOS_STRING);
+	term_rule(TERM_ESCAPE, 'X', 'X', TERM_ACT_NONE, TERM_SOS_STRING);
+	term_rule(TERM_ESCAPE, '^', '_', TERM_ACT_NONE, TERM_SOS_STRING);
+
+	/* escape intermediate */
+	term_rule_c0(TERM_ESCAPE_INTER, TERM_ACT_EXECUTE);
+	term_rule(TERM_ESCAPE_INTER, 0x20, 0x2f, TERM_ACT_COLLECT, TERM_ESCAPE_INTER);
+	term_rule(TERM_ESCAPE_INTER, 0x30, 0x7e, TERM_ACT_ESC_DISPATCH, TERM_GROUND);
+
+	/* csi entry; a leading < = > or ? is a private marker */
+	term_rule_c0(TERM_CSI_ENTRY, TERM_ACT_EXECUTE);
+	term_rule(TERM_CSI_ENTRY, 0x20, 0x2f, TERM_ACT_COLLECT, TERM_CSI_INTER);
+	term_rule(TERM_CSI_ENTRY, 0x30, 0x39, TERM_ACT_PARAM, TERM_CSI_PARAM);
+	term_rule(TERM_CSI_ENTRY, 0x3a, 0x3a, TERM_ACT_NONE, TERM_CSI_IGNORE);
+	term_rule(TERM_CSI_ENTRY, 0x3b, 0x3b, TERM_ACT_PARAM, TERM_CSI_PARAM);
+	term_rule(TERM_CSI_ENTRY, 0x3c, 0x3f, TERM_ACT_COLLECT, TERM_CSI_PARAM);
+	term_rule(TERM_CSI_ENTRY, 0x40, 0x7e, TERM_ACT_CSI_DISPATCH, TERM_GROUND);
+
+	/* csi parameters */
+	term_rule_c0(TERM_CSI_PARAM, TERM_ACT_EXECUTE);
+	term_rule(TERM_CSI_PARAM, 0x20, 0x2f, TERM_ACT_COLLECT, TERM_CSI_INTER);
+	term_rule(TERM_CSI_PARAM, 0x30, 0x39, TERM_ACT_PARAM, TERM_CSI_PARAM);
+	term_rule(TERM_CSI_PARAM, 0x3a, 0x3a, TERM_ACT_NONE, TERM_CSI_IGNORE);
+	term_rule(TERM_CSI_PARAM, 0x3b, 0x3b, TERM_ACT_PARAM, TERM_CSI_PARAM);
+	term_rule(TERM_CSI_PARAM, 0x3c, 0x3f, TERM_ACT_NONE, TERM_CSI_IGNORE);
+	term_rule(TERM_CSI_PARAM, 0x40, 0x7e, TERM_ACT_CSI_DISPATCH, TERM_GROUND);
+
+	/* csi intermediate */
+	term_rule_c0(TERM_CSI_INTER, TERM_ACT_EXECUTE);
+	term_rule(TERM_CSI_INTER, 0x20, 0x2f, TERM_ACT_COLLECT, TERM_CSI_INTER);
+	term_rule(TERM_CSI_INTER, 0x30, 0x3f, TERM_ACT_NONE, TERM_CSI_IGNORE);
+	term_rule(TERM_CSI_INTER, 0x40, 0x7e, TERM_ACT_CSI_DISPATCH, TERM_GROUND);
+
+	/* malformed csi, swallowed up to the final byte */
+	term_rule_c0(TERM_CSI_IGNORE, TERM_ACT_EXECUTE);
+	term_rule(TERM_CSI_IGNORE, 0x40, 0x7e, TERM_ACT_NONE, TERM_GROUND);
+
+	/* osc strings also end at BEL, as in xterm; string contents are
+	 * dropped, the ESC of a closing ST goes through the escape state */
+	term_rule(TERM_OSC_STRING, 0x07, 0x07, TERM_ACT_NONE, TERM_GROUND);
+
+	/* CAN and SUB abort any sequence, ESC starts a new one */
+	for (s = 0; s != TERM_STATES; ++s) {
+		term_rule(s, 0x18, 0x18, TERM_ACT_NONE, TERM_GROUND);
+		term_rule(s, 0x1a, 0x1a, TERM_ACT_NONE, TERM_GROUND);
+		term_rule(s, 0x1b, 0x1b, TERM_ACT_CLEAR, TERM_ESCAPE);
+	}
+}
+
+/* perform a parser action for byte c */
+static void term_action (term_action_t action, unsigned char c) {
+	int* param;
+
+	switch (action) {
+		case TERM_ACT_NONE:
+			break;
+		case TERM_ACT_EXECUTE:
+			/* ESC never gets here; CR is left to the following LF */
+			if (c != '\r')
+				term_control(c);
+			textline_control(c);
+			break;
+		case TERM_ACT_CLEAR:
+			terminal.esc_cnt = 0;
+			terminal.esc_buf[0] = 0;
+			terminal.collect = 0;
+			break;
+		case TERM_ACT_COLLECT:
+			terminal.collect = c;
+			break;
+		case TERM_ACT_PARAM:
+			/* an omitted leading parameter still counts as a zero */
+			if (terminal.esc_cnt == 0)
+				terminal.esc_cnt = 1;
+			if (c == ';') {
+				if (terminal.esc_cnt < TERM_MAX_ESC)
+					terminal.esc_buf[terminal.esc_cnt++] = 0;
+				break;
+			}
+			param = &terminal.esc_buf[terminal.esc_cnt - 1];
+			if (*param < TERM_MAX_PARAM)
+				*param = *param * 10 + (c - '0');
+			break;
+		case TERM_ACT_ESC_DISPATCH:
+			/* no plain escapes are supported */
+			break;
+		case TERM_ACT_CSI_DISPATCH:
+			/* private and intermediate forms are not ours */
+			if (terminal.collect == 0)
+				on_term_esc(c);
+			break;
+	}
+}
+
+/* process text into virtual terminal; parser state lives in terminal,
+ * so sequences may be split across calls */
+static void on_text_ansi (const char* text, size_t len) {
+	size_t i = 0;
+	size_t run;
+	unsigned char entry;
+	size_t cols;
+
+	dirty |= DIRTY_MAIN;
+	while (i < len) {
+		/* emit whole runs of printable text at once */
+		if (terminal.state == TERM_GROUND) {
+			run = term_run_length(text + i, len - i);
+			if (run != 0) {
+				cols = term_write(text + i, run);
+				textline_write(text + i, run, cols);
+				i += run;
+				continue;
+			}
+		}
+
+		if (terminal.utf8_left != 0)
+			textline_write(text + i, 0, term_utf8_abort());
+
+		entry = term_table[terminal.state][(unsigned char)text[i]];
+		terminal.state = entry & 0x0f;
+		term_action(entry >> 4, text[i]);
+		++i;
+	}
+}
+
+/* report a connection state change to the main loop */
+static void connect_notify (conn_state_t state) {
+	unsigned char byte = state;
+
+	if (connect_pipe[1] != -1)
+		while (write(connect_pipe[1], &byte, 1) == -1 && errno == EINTR)
+			;
+}
+
+/* start a non-blocking connect, returns the socket or -1 */
+static int connect_start (struct addrinfo* ai, int* error) {
+	int sock;
+
+	sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (sock == -1) {
+		*error = errno;
+		return -1;
+	}
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	sockopt_apply(sock);
+	if (connect(sock, ai->ai_addr, ai->ai_addrlen) == -1 && errno != EINPROGRESS) {
+		*error = errno;
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* attempt to connect to the requested hostname on the request port;
+ * addresses are raced RFC 8305 style, alternating between families and
+ * starting a new attempt every CONNECT_DELAY_MS while older ones are
+ * still pending, and the first to complete wins */
+static int do_connect (const char* host, const char* port) {
+	struct addrinfo hints;
+	struct addrinfo *results;
+	struct addrinfo *ai;
+	struct addrinfo* first[CONNECT_MAX];
+	struct addrinfo* other[CONNECT_MAX];
+	struct addrinfo* order[CONNECT_MAX];
+	struct pollfd fds[CONNECT_MAX];
+	size_t nfirst = 0;
+	size_t nother = 0;
+	size_t count = 0;
+	size_t started = 0;
+	size_t pending = 0;
+	size_t i;
+	double start;
+	double next;
+	double now;
+	int timeout;
+	int error = ECONNREFUSED;
+	socklen_t len;
+	int ret;
+	int sock = -1;
+
+	/* lookup host */
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((ret = getaddrinfo(host, port, &hints, &results)) != 0) {
+		snprintf(connect_error, sizeof(connect_error), "Host lookup failed: %s", gai_strerror(ret));
+		return -1;
+	}
+	connect_notify(CONN_CONNECTING);
+
+	/* interleave address families, starting with whichever family the
+	 * resolver preferred */
+	for (ai = results; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_family == results->ai_family) {
+			if (nfirst != CONNECT_MAX)
+				first[nfirst++] = ai;
+		} else if (nother != CONNECT_MAX) {
+			other[nother++] = ai;
+		}
+	}
+	for (i = 0; (i < nfirst || i < nother) && count != CONNECT_MAX; ++i) {
+		if (i < nfirst)
+			order[count++] = first[i];
+		if (i < nother && count != CONNECT_MAX)
+			order[count++] = other[i];
+	}
+
+	start = next = now_sec();
+	while (sock == -1) {
+		now = now_sec();
+		if (now - start >= connect_timeout) {
+			snprintf(connect_error, sizeof(connect_error), "Connection timed out");
+			break;
+		}
+
+		/* start the next attempt when its turn comes, or right away
+		 * if nothing else is in flight; one that fails at once doesn't
+		 * hold up the one after it */
+		if (started != count && (now >= next || pending == 0)) {
+			fds[started].fd = connect_start(order[started], &error);
+			fds[started].events = POLLOUT;
+			if (fds[started].fd != -1) {
+				++pending;
+				next = now + CONNECT_DELAY_MS / 1000.0;
+			} else {
+				next = now;
+			}
+			++started;
+			continue;
+		}
+
+		/* everything failed */
+		if (pending == 0) {
+			snprintf(connect_error, sizeof(connect_error), "%s", strerror(error));
+			break;
+		}
+
+		/* wait for a result, the next attempt or the deadline */
+		timeout = (int)((start + connect_timeout - now) * 1000) + 1;
+		if (started != count && (int)((next - now) * 1000) + 1 < timeout)
+			timeout = (int)((next - now) * 1000) + 1;
+		if (poll(fds, started, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			snprintf(connect_error, sizeof(connect_error), "poll() failed: %s", strerror(errno));
+			break;
+		}
+
+		/* check for winners; failures are closed and skipped, and the
+		 * next address starts at once rather than at its turn, as in
+		 * RFC 8305 section 5 */
+		for (i = 0; i != started && sock == -1; ++i) {
+			if (fds[i].fd == -1 || fds[i].revents == 0)
+				continue;
+
+			len = sizeof(error);
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+				error = errno;
+			if (error == 0) {
+				sock = fds[i].fd;
+				fds[i].fd = -1;
+				connect_time = now_sec() - start;
+				getnameinfo(order[i]->ai_addr, order[i]->ai_addrlen, connect_addr,
+						sizeof(connect_addr), NULL, 0, NI_NUMERICHOST);
+			} else {
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				--pending;
+				next = now_sec();
+			}
+		}
+	}
+
+	/* release the losers */
+	for (i = 0; i != started; ++i)
+		if (fds[i].fd != -1)
+			close(fds[i].fd);
+
+	freeaddrinfo(results);
+	return sock;
+}
+
+/* connection thread body */
+static void* connect_run (void* ud) {
+	connect_sock = do_connect(host, port);
+	connect_notify(connect_sock != -1 ? CONN_OPEN : CONN_FAILED);
+	return NULL;
+}
+
+/* start resolving and connecting in the background */
+static void connect_begin (void) {
+	sigset_t all;
+	sigset_t old;
+	int ret;
+
+	if (pipe(connect_pipe) == -1) {
+		fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	fcntl(connect_pipe[0], F_SETFL, O_NONBLOCK);
+
+	/* signals belong to the main thread, so they interrupt its poll() */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&connect_thread, NULL, connect_run, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create() failed: %s\n", strerror(ret));
+		exit(1);
+	}
+
+	conn_state = CONN_RESOLVING;
+}
+
+/* handle state changes from the connection thread; returns 1 once the
+ * thread is done */
+static int connect_update (void) {
+	unsigned char byte;
+
+	while (conn_state != CONN_OPEN && conn_state != CONN_FAILED) {
+		if (read(connect_pipe[0], &byte, 1) != 1)
+			return 0;
+		conn_state = byte;
+		dirty |= DIRTY_BANNER;
+	}
+
+	pthread_join(connect_thread, NULL);
+	close(connect_pipe[0]);
+	close(connect_pipe[1]);
+	connect_pipe[0] = connect_pipe[1] = -1;
+
+	/* failed; leave the reason on screen */
+	if (conn_state == CONN_FAILED) {
+		on_warning(connect_error);
+		running = 0;
+		return 1;
+	}
+
+	/* connected; send anything typed in the meantime */
+	sock = connect_sock;
+	wattrset(win_main, COLOR_PAIR(COLOR_GREEN));
+	on_text_plain("Connected via ", 14);
+	on_text_plain(connect_addr, strlen(connect_addr));
+	term_apply();
+	on_text_plain("\n", 1);
+	if (sendq.len != 0)
+		sendq_flush();
+	return 1;
+}
+
+int main (int argc, char** argv) {
+	const char* default_port = "23";
+	size_t scrollback_lines = SCROLLBACK_DEFAULT;
+	const char* replay_path = NULL;
+	const char* capture_path = NULL;
+	const char* log_path = NULL;
+	const char* history_path = NULL;
+	const struct CHARSET* server_charset = charsets;
+#ifdef HAVE_ZLIB
+	const char* dump_path = NULL;
+	double dump_since = 0;
+#endif
+	FILE* null_out = NULL;
+	double startup = now_sec();
+	double first_frame;
+	int timeout;
+	struct sigaction sa;
+	int i;
+
+	/* process command line args */
+	for (i = 1; i < argc; ++i) {
+		/* help */
+		if (strcmp(argv[i], "-h") == 0) {
+			printf(
+				"CLC %s by Sean Middleditch <elanthis@sourcemud.org>\n"
+				"This program has been released into the PUBLIC DOMAIN.\n\n"
+				"Usage:\n"
+				"  clc [-h] [-b <bytes>] [-f <fps>] [-s <lines>] [-c <file>] [-t <secs>] [-T <file>] [-a <file>] [-H <file>]\n"
+				"      [-e <charset>] [-o <option>=<value>] [-l <file> [--log-block] [--log-zlib]] <host> [<port>]\n"
+				"  clc [-b <bytes>] [-s <lines>] [-T <file>] [-l <file>] [-e <charset>] --replay <file> [--realtime|--bench]\n"
+				"  clc --log-dump <file> [--log-since <time>]\n\n"
+				"Options:\n"
+				"  -h   display help\n"
+				"  -b   size of the receive buffer (default %d)\n"
+				"  -f   maximum screen updates per second, 0 for no limit (default %d)\n"
+				"  -s   lines of scrollback to keep (default %d)\n"
+				"  -c   capture the session, with timestamps, to a file\n"
+				"  -t   seconds to wait for a connection (default %d)\n"
+				"  -T   load triggers from a file\n"
+				"  -a   load aliases from a file\n"
+				"  -H   keep the input history in a file\n"
+				"  -e   server charset until the server names one: UTF-8 (default),\n"
+				"       ISO-8859-1, IBM437 or US-ASCII\n"
+				"  -o   set a socket option: nodelay, rcvbuf, sndbuf, keepalive,\n"
+				"       keepidle, keepintvl, keepcnt or user_timeout\n"
+				"  -l   log the session text to a file\n"
+				"  --log-block  wait for the log writer instead of dropping lines\n"
+				"  --log-zlib   write the log as seekable compressed blocks\n"
+				"  --log-dump   print a compressed log\n"
+				"  --log-since  start the dump at a time, in seconds since the epoch\n"
+				"  --replay    display a capture or raw server output instead of connecting\n"
+				"  --realtime  replay a capture at its recorded speed\n"
+				"  --bench     run the replay offscreen and report timings\n\n"
+				"Client commands:\n"
+				"  #set <option> <value>  change a socket option once connected\n"
+				"  #stats                 show socket options and connection statistics\n"
+				"  Any other line goes to the server; start it with ## to send a\n"
+				"  #set or #stats of the server's own, minus the first #.\n",
+				CLC_VERSION, RECVBUF_DEFAULT, FPS_DEFAULT, SCROLLBACK_DEFAULT,
+				CONNECT_TIMEOUT_DEFAULT
+			);
+			return 0;
+		}
+
+		/* replay a recorded session */
+		if (strcmp(argv[i], "--replay") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Option --replay requires a file.\n");
+				exit(1);
+			}
+			replay_path = argv[i];
+			continue;
+		}
+
+		/* replay at recorded speed */
+		if (strcmp(argv[i], "--realtime") == 0) {
+			replay.realtime = 1;
+			continue;
+		}
+
+		/* connect timeout */
+		if (strcmp(argv[i], "-t") == 0) {
+			if (++i == argc || atoi(argv[i]) <= 0) {
+				fprintf(stderr, "Option -t requires a number of seconds.\n");
+				exit(1);
+			}
+			connect_timeout = atoi(argv[i]);
+			continue;
+		}
+
+		/* trigger file */
+		if (strcmp(argv[i], "-T") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Option -T requires a file.\n");
+				exit(1);
+			}
+			trigger_load(argv[i]);
+			continue;
+		}
+
+		/* socket option */
+		if (strcmp(argv[i], "-o") == 0) {
+			char* value;
+			if (++i == argc || (value = strchr(argv[i], '=')) == NULL) {
+				fprintf(stderr, "Option -o requires an option=value.\n");
+				exit(1);
+			}
+			*value++ = '\0';
+			if (sockopt_parse(argv[i], value) == NULL) {
+				fprintf(stderr, "Unknown socket option or bad value: %s=%s\n", argv[i], value);
+				exit(1);
+			}
+			continue;
+		}
+
+		/* session log */
+		if (strcmp(argv[i], "-l") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Option -l requires a file.\n");
+				exit(1);
+			}
+			log_path = argv[i];
+			continue;
+		}
+
+		/* log overflow policy */
+		if (strcmp(argv[i], "--log-block") == 0) {
+			sessionlog.block = 1;
+			continue;
+		}
+
+		/* compressed log */
+		if (strcmp(argv[i], "--log-zlib") == 0) {
+#ifdef HAVE_ZLIB
+			sessionlog.zlib = 1;
+			continue;
+#else
+			fprintf(stderr, "Option --log-zlib requires zlib support.\n");
+			exit(1);
+#endif
+		}
+
+		/* print a compressed log */
+		if (strcmp(argv[i], "--log-dump") == 0) {
+#ifdef HAVE_ZLIB
+			if (++i == argc) {
+				fprintf(stderr, "Option --log-dump requires a file.\n");
+				exit(1);
+			}
+			dump_path = argv[i];
+			continue;
+#else
+			fprintf(stderr, "Option --log-dump requires zlib support.\n");
+			exit(1);
+#endif
+		}
+
+#ifdef HAVE_ZLIB
+		/* where to start the dump */
+		if (strcmp(argv[i], "--log-since") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Option --log-since requires a time.\n");
+				exit(1);
+			}
+			dump_since = atof(argv[i]);
+			continue;
+		}
+#endif
+
+		/* server charset */
+		if (strcmp(argv[i], "-e") == 0) {
+			if (++i == argc || (server_charset = charset_find(argv[i], strlen(argv[i]))) == NULL) {
+				fprintf(stderr, "Option -e requires a charset: UTF-8, ISO-8859-1, IBM437 or US-ASCII.\n");
+				exit(1);
+			}
+			continue;
+		}
+
+		/* history file */
+		if (strcmp(argv[i], "-H") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Option -H requires a file.\n");
+				exit(1);
+			}
+			history_path = argv[i];
+			continue;
+		}
+
+		/* alias file */
+		if (strcmp(argv[i], "-a") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Option -a requires a file.\n");
+				exit(1);
+			}
+			alias_load(argv[i]);
+			continue;
+		}
+
+		/* capture file */
+		if (strcmp(argv[i], "-c") == 0) {
+			if (++i == argc) {
+				fprintf(stderr, "Option -c requires a file.\n");
+				exit(1);
+			}
+			capture_path = argv[i];
+			continue;
+		}
+
+		/* benchmark the replay */
+		if (strcmp(argv[i], "--bench") == 0) {
+			bench.active = 1;
+			continue;
+		}
+
+		/* scrollback size */
+		if (strcmp(argv[i], "-s") == 0) {
+			if (++i == argc || atoi(argv[i]) < 0) {
+				fprintf(stderr, "Option -s requires a number of lines.\n");
+				exit(1);
+			}
+			scrollback_lines = atoi(argv[i]);
+			continue;
+		}
+
+		/* receive buffer size */
+		if (strcmp(argv[i], "-b") == 0) {
+			if (++i == argc || atoi(argv[i]) < RECVBUF_MIN) {
+				fprintf(stderr, "Option -b requires a size of at least %d.\n", RECVBUF_MIN);
+				exit(1);
+			}
+			recvbuf_size = atoi(argv[i]);
+			continue;
+		}
+
+		/* frame rate cap */
+		if (strcmp(argv[i], "-f") == 0) {
+			if (++i == argc || atoi(argv[i]) < 0) {
+				fprintf(stderr, "Option -f requires a frame rate.\n");
+				exit(1);
+			}
+			max_fps = atoi(argv[i]);
+			continue;
+		}
+
+		/* other unknown option */
+		if (argv[i][0] == '-') {
+			fprintf(stderr, "Unknown option %s.\nUse -h to see available options.\n", argv[i]);
+			exit(1);
+		}
+
+		/* if host is unset, this is the host */
+		if (host == NULL) {
+			host = argv[i];
+		/* otherwise, it's a port */
+		} else {
+			port = argv[i];
+		}
+	}
+
+#ifdef HAVE_ZLIB
+	/* dumping a log needs no session */
+	if (dump_path != NULL)
+		return log_dump(dump_path, dump_since);
+#endif
+
+	/* benchmarks need something to run */
+	if (bench.active && replay_path == NULL) {
+		fprintf(stderr, "Option --bench requires --replay.\n");
+		exit(1);
+	}
+
+	/* benchmarks always run flat out */
+	if (bench.active)
+		replay.realtime = 0;
+
+	/* ensure we have a host */
+	if (host == NULL && replay_path == NULL) {
+		fprintf(stderr, "No host was given.\nUse -h to see command format.\n");
+		exit(1);
+	}
+
+	/* set default port if none was given */
+	if (port == NULL)
+		port = default_port;
+
+	/* cleanup on any failure */
+	atexit(cleanup);
+
+	/* pick the printable run scanner */
+	scan_init();
+	width_init();
+
+	/* set terminal defaults */
+	memset(&terminal, 0, sizeof(struct TERMINAL));
+	terminal.state = TERM_GROUND;
+	term_init();
+	terminal.flags = TERM_FLAGS_DEFAULT;
+	terminal.fg = terminal.bg = TERM_COLOR_NONE;
+	terminal.attrs = A_NORMAL;
+	charset_select(server_charset);
+
+	/* scrollback store */
+	scrollback_init(scrollback_lines);
+
+	/* initial telnet handler */
+	telnet = telnet_init(telnet_telopts, telnet_event, 0, 0);
+	zmp_init();
+
+	/* replays have no server */
+	if (replay_path != NULL) {
+		host = replay_path;
+		port = "replay";
+		sock = -1;
+		replay_open(replay_path);
+	} else {
+		/* connect to server while the display comes up; the socket is
+		 * left non-blocking, and output is queued instead */
+		sock = -1;
+		connect_begin();
+
+		/* record the session */
+		if (capture_path != NULL)
+			capture_open(capture_path);
+	}
+
+	/* session log, for replays too */
+	if (log_path != NULL)
+		log_open(log_path);
+
+	/* input history, kept in memory only without a file */
+	history_open(history_path);
+
+	/* allocate receive buffer */
+	recvbuf = (char*)malloc(recvbuf_size);
+	if (recvbuf == NULL) {
+		fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	/* set initial banner */
+	snprintf(banner, sizeof(banner), "CLC - %s:%s (connected)", host, port);
+
+	/* curses writes wide characters in the user's encoding */
+	setlocale(LC_CTYPE, "");
+
+	/* configure curses; benchmarks draw to /dev/null instead of the tty */
+	if (bench.active) {
+		null_out = fopen("/dev/null", "w");
+		if (null_out == NULL || newterm(getenv("TERM") != NULL ? getenv("TERM") : "xterm", null_out, stdin) == NULL) {
+			fprintf(stderr, "Failed to create offscreen terminal\n");
+			exit(1);
+		}
+	} else {
+		initscr();
+	}
+	start_color();
+	nonl();
+	cbreak();
+	noecho();
+
+	win_main = newwin(LINES-2, COLS, 0, 0);
+	win_scroll = newwin(LINES-2, COLS, 0, 0);
+	win_banner = newwin(1, COLS, LINES-2, 0);
+	win_input = newwin(1, COLS, LINES-1, 0);
+
+	idlok(win_main, TRUE);
+	scrollok(win_main, TRUE);
+
+	nodelay(win_input, TRUE);
+	keypad(win_input, TRUE);
+
+	use_default_colors();
+
+	init_pair(COLOR_RED, COLOR_RED, -1);
+	init_pair(COLOR_BLUE, COLOR_BLUE, -1);
+	init_pair(COLOR_GREEN, COLOR_GREEN, -1);
+	init_pair(COLOR_CYAN, COLOR_CYAN, -1);
+	init_pair(COLOR_MAGENTA, COLOR_MAGENTA, -1);
+	init_pair(COLOR_YELLOW, COLOR_YELLOW, -1);
+	init_pair(COLOR_WHITE, COLOR_WHITE, -1);
+
+	init_pair(TERM_COLOR_DEFAULT, -1, -1);
+	wbkgd(win_main, COLOR_PAIR(TERM_COLOR_DEFAULT));
+	wclear(win_main);
+	wbkgd(win_scroll, COLOR_PAIR(TERM_COLOR_DEFAULT));
+	init_pair(10, COLOR_WHITE, COLOR_BLUE);
+	wbkgd(win_banner, COLOR_PAIR(10));
+	wclear(win_banner);
+	init_pair(11, -1, -1);
+	wbkgd(win_input, COLOR_PAIR(11));
+	wclear(win_input);
+
+	paircache_init();
+
+	redraw_display();
+	first_frame = now_sec() - startup;
+
+	/* run a benchmark and report */
+	if (bench.active) {
+		double start = now_sec();
+		replay_step();
+		double total = now_sec() - start;
+		endwin();
+		bench_report(total);
+		bench_scan(replay_path);
+		trigger_report();
+		log_close();
+		log_report();
+
+		telnet_free(telnet);
+		zmp_free();
+		trigger_free();
+		alias_free();
+		history_close();
+		charset_free();
+		free(recvbuf);
+		scrollback_free();
+		return 0;
+	}
+
+	/* show a replay (or its first records), then sit in the main loop */
+	if (replay.data != NULL)
+		replay_step();
+
+	/* set signal handlers */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGWINCH, &sa, NULL);
+
+	/* a reset connection comes back as EPIPE from writev, which restores
+	 * the terminal before reporting it, instead of killing us outright */
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	/* initial edit buffer */
+	memset(&editbuf, 0, sizeof(struct EDITBUF));
+	editbuf.changed = EDITBUF_CLEAN;
+	editbuf_reserve(0);
+
+	/* setup poll info */
+	struct pollfd fds[3];
+	fds[0].fd = 1;
+	fds[0].events = POLLIN;
+	fds[1].fd = sock;
+	fds[1].events = POLLIN;
+	fds[2].fd = connect_pipe[0];
+	fds[2].events = POLLIN;
+
+	/* main loop */
+	while (running) {
+		/* only wait for writability while output is queued */
+		fds[1].events = sendq.len != 0 ? POLLIN | POLLOUT : POLLIN;
+
+		/* wake up for the next frame if output is pending, or for the
+		 * next record of a realtime replay */
+		timeout = dirty & (DIRTY_MAIN | DIRTY_BANNER) ? paint_delay() : -1;
+		if (replay_delay() != -1 && (timeout == -1 || replay_delay() < timeout))
+			timeout = replay_delay();
+
+		/* an unfinished search only checks for input between slices */
+		if (search.pending)
+			timeout = 0;
+
+		/* poll sockets */
+		if (poll(fds, 3, timeout) == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				endwin();
+				fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+				return 1;
+			}
+			fds[0].revents = fds[1].revents = fds[2].revents = 0;
+		}
+
+		/* resize event? */
+		if (have_sigwinch) {
+			have_sigwinch = 0;
+			redraw_display();
+		}
+
+		/* escape? */
+		if (have_sigint) {
+			exit(0);
+		}
+
+		/* input? take every key that is waiting, so a paste is one batch */
+		if (fds[0].revents & POLLIN) {
+			int key;
+			while ((key = wgetch(win_input)) != ERR)
+				on_key(key);
+		}
+
+		/* connection progress */
+		if (fds[2].revents & POLLIN) {
+			if (connect_update()) {
+				fds[1].fd = sock;
+				fds[2].fd = -1;
+			}
+		}
+
+		/* process input data; hangups and errors show up from recv() */
+		if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+			recv_drain();
+
+		/* continue a realtime replay */
+		if (replay.data != NULL)
+			replay_step();
+
+		/* continue a search */
+		if (search.pending)
+			search_step();
+
+		/* send everything this iteration produced */
+		if (sock != -1 && sendq.len != 0)
+			sendq_flush();
+
+		/* flush output */
+		refresh_display(0);
+	}
+
+	/* final display, pause */
+	sent_segments = send_segments();
+	sock = -1;
+	autobanner = 1;
+	dirty |= DIRTY_MAIN | DIRTY_BANNER;
+	refresh_display(1);
+	nodelay(win_input, FALSE);
+	wgetch(win_input);
+
+	/* clean up */
+	endwin();
+	printf("First frame drawn %.1f ms after startup.\n", first_frame * 1000);
+	if (conn_state == CONN_FAILED) {
+		printf("Failed to connect to %s:%s: %s\n", host, port, connect_error);
+	} else {
+		if (conn_state == CONN_OPEN)
+			printf("Connected to %s:%s via %s in %.0f ms.\n", host, port,
+					connect_addr, connect_time * 1000);
+		printf("Disconnected.\n");
+		printf("Received %zu bytes in %zu wakeups (%zu average, %zu max per wakeup).\n",
+				recv_bytes, recv_wakeups,
+				recv_wakeups != 0 ? recv_bytes / recv_wakeups : 0, recv_burst_max);
+		printf("Sent %zu bytes, %zu commands in %zu writes (%.2f per command).\n",
+				sent_bytes, sent_commands, sent_writes,
+				sent_commands != 0 ? (double)sent_writes / sent_commands : 0.0);
+		if (sent_segments != -1)
+			printf("Sent %ld TCP segments (%.2f per command).\n", sent_segments,
+					sent_commands != 0 ? (double)sent_segments / sent_commands : 0.0);
+	}
+	trigger_report();
+	log_close();
+	log_report();
+
+	/* free memory (so Valgrind leak detection is useful) */
+#ifdef HAVE_ZLIB
+	mccp_end();
+#endif
+	telnet_free(telnet);
+	zmp_free();
+	trigger_free();
+	alias_free();
+	free(replay.data);
+	history_close();
+	charset_free();
+	if (capture != NULL)
+		fclose(capture);
+	free(sendq.buf);
+	free(recvbuf);
+	scrollback_free();
+
+	return 0;
+}
+
+/* ======= TELNET ======= */
+
+/* telnet event handler */
+static void telnet_event (telnet_t* telnet, telnet_event_t* ev, void* ud) {
+	const char* text;
+	size_t len;
+	double start, mid;
+
+	switch (ev->type) {
+	case TELNET_EV_DATA:
+		text = ev->data.buffer;
+		len = ev->data.size;
+		if (bench.active) {
+			start = now_sec();
+			if (charset.current->legacy)
+				text = charset_decode(text, &len);
+			mid = now_sec();
+			on_text_ansi(text, len);
+			bench.charset += mid - start;
+			bench.render += now_sec() - mid;
+		} else {
+			if (charset.current->legacy)
+				text = charset_decode(text, &len);
+			on_text_ansi(text, len);
+		}
+		break;
+	case TELNET_EV_SEND:
+		do_send(ev->data.buffer, ev->data.size);
+		break;
+	case TELNET_EV_WILL:
+		if (ev->neg.telopt == TELNET_TELOPT_ECHO)
+			terminal.flags &= ~TERM_FLAG_ECHO;
+		else if (ev->neg.telopt == TELNET_TELOPT_ZMP) {
+			terminal.flags |= TERM_FLAG_ZMP;
+			telnet_send_zmpv(telnet, "zmp.ident", "clc", "n/a", "simple command-line client", NULL);
+		}
+		break;
+	case TELNET_EV_WONT:
+		if (ev->neg.telopt == TELNET_TELOPT_ECHO)
+			terminal.flags |= TERM_FLAG_ECHO;
+		break;
+	case TELNET_EV_DO:
+		if (ev->neg.telopt == TELNET_TELOPT_NAWS) {
+			terminal.flags |= TERM_FLAG_NAWS;
+			send_naws();
+		} else if (ev->neg.telopt == TELNET_TELOPT_CHARSET)
+			charset_request();
+		break;
+	case TELNET_EV_SUBNEGOTIATION:
+		if (ev->sub.telopt == TELNET_TELOPT_CHARSET)
+			charset_sb(ev->sub.buffer, ev->sub.size);
+		break;
+	case TELNET_EV_ZMP:
+		do_zmp(ev->zmp.argc, ev->zmp.argv);
+		break;
+	case TELNET_EV_WARNING:
+		on_warning(ev->error.msg);
+		break;
+	case TELNET_EV_ERROR:
+		endwin();
+		fprintf(stderr, "TELNET error: %s\n", ev->error.msg);
+		exit(1);
+	default:
+		break;
+	}
+
+	++bench.events;
+}
+	
+/* queue one command for the current send_line */
+static void send_command (const char* line, size_t len) {
+	/* grow the buffer to fit the command and its CR LF */
+	if (cmdbuf.len + len + 2 > cmdbuf.size) {
+		cmdbuf.size = cmdbuf.size != 0 ? cmdbuf.size : 256;
+		while (cmdbuf.len + len + 2 > cmdbuf.size)
+			cmdbuf.size *= 2;
+		cmdbuf.buf = (char*)realloc(cmdbuf.buf, cmdbuf.size);
+		if (cmdbuf.buf == NULL) {
+			endwin();
+			fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	if (charset.current->legacy) {
+		cmdbuf.len += charset_encode(line, len, cmdbuf.buf + cmdbuf.len);
+	} else {
+		memcpy(cmdbuf.buf + cmdbuf.len, line, len);
+		cmdbuf.len += len;
+	}
+	cmdbuf.buf[cmdbuf.len++] = '\r';
+	cmdbuf.buf[cmdbuf.len++] = '\n';
+	++sent_commands;
+
+	/* echo output; only echoed commands are logged, so passwords aren't */
+	if (terminal.flags & TERM_FLAG_ECHO) {
+		wattrset(win_main, COLOR_PAIR(COLOR_YELLOW));
+		on_text_plain(line, len);
+		on_text_plain("\n", 1);
+		term_apply();
+		if (sessionlog.active)
+			log_line(line, len);
+	}
+}
+
+/* send a line to the server, expanding aliases; all the commands it
+ * turns into go out in one write */
+static void send_line (const char* line, size_t len) {
+	cmdbuf.len = 0;
+	cmdbuf.commands = 0;
+	cmdbuf.capped = 0;
+	cmdbuf.truncated = 0;
+	alias_expand(line, len, 0);
+	if (cmdbuf.len != 0)
+		telnet_send(telnet, cmdbuf.buf, cmdbuf.len);
+}
+
+/* send NAWS update */
+static void send_naws (void) {
+	unsigned short w = htons(COLS), h = htons(LINES);
+
+	/* send NAWS if enabled */
+	if (terminal.flags & TERM_FLAG_NAWS) {
+		telnet_begin_sb(telnet, TELOPT_NAWS);
+		telnet_send(telnet, (char*)&w, 2);
+		telnet_send(telnet, (char*)&h, 2);
+		telnet_finish_sb(telnet);
+	}
+}
+
+/* do ZMP */
+static void do_zmp (size_t argc, const char **argv) {
+	struct ZMPCMD* cmd;
+
+	if (argc == 0)
+		return;
+
+	/* deal with command */
+	cmd = zmp_find(argv[0], strlen(argv[0]));
+	if (cmd != NULL)
+		cmd->cb(argc, argv);
+}
+
+#ifdef HAVE_ZLIB
+/* ======= MCCP ======= */
+
+/* stop decompressing; anything after this is plain telnet again */
+static void mccp_end (void) {
+	if (mccp.active) {
+		inflateEnd(&mccp.zs);
+		mccp.active = 0;
+	}
+}
+
+/* inflate compressed bytes into telnet, returns number of bytes used */
+static size_t mccp_inflate (const char* bytes, size_t len) {
+	char out[8192];
+	size_t used;
+	int rs;
+
+	mccp.zs.next_in = (Bytef*)bytes;
+	mccp.zs.avail_in = len;
+
+	do {
+		mccp.zs.next_out = (Bytef*)out;
+		mccp.zs.avail_out = sizeof(out);
+		rs = inflate(&mccp.zs, Z_SYNC_FLUSH);
+
+		/* pass along whatever was inflated */
+		if (mccp.zs.avail_out != sizeof(out)) {
+			mccp.out_bytes += sizeof(out) - mccp.zs.avail_out;
+			telnet_recv(telnet, out, sizeof(out) - mccp.zs.avail_out);
+		}
+	} while (rs == Z_OK && (mccp.zs.avail_in != 0 || mccp.zs.avail_out == 0));
+
+	used = len - mccp.zs.avail_in;
+	mccp.in_bytes += used;
+
+	/* server ended compression; the rest of the buffer is plain */
+	if (rs == Z_STREAM_END) {
+		mccp_end();
+		return used;
+	}
+
+	/* corrupt stream; ask the server to stop and drop what we have,
+	 * since there is no way to resynchronize a deflate stream */
+	if (rs != Z_OK && rs != Z_BUF_ERROR) {
+		on_warning(mccp.zs.msg != NULL ? mccp.zs.msg : "MCCP inflate failed");
+		mccp_end();
+		telnet_negotiate(telnet, TELNET_DONT, TELNET_TELOPT_COMPRESS2);
+		return len;
+	}
+
+	return used;
+}
+
+/* feed received bytes to telnet, inflating MCCP2 sections */
+static void mccp_recv (const char* bytes, size_t len) {
+	static const char mark[] = {
+		(char)TELNET_IAC, (char)TELNET_SB, (char)TELNET_TELOPT_COMPRESS2,
+		(char)TELNET_IAC, (char)TELNET_SE
+	};
+	size_t from;
+	size_t used;
+	size_t i;
+
+	while (len != 0) {
+		/* inside a compressed section */
+		if (mccp.active) {
+			used = mccp_inflate(bytes, len);
+			bytes += used;
+			len -= used;
+			continue;
+		}
+
+		/* search for the start marker; a partial match at the end of
+		 * the buffer is held back until the next call decides it */
+		mccp.held = mccp.match;
+		for (from = 0, i = 0; i != len; ++i) {
+			if (bytes[i] == mark[mccp.match]) {
+				if (++mccp.match == sizeof(mark))
+					break;
+				continue;
+			}
+
+			/* mismatch; release marker bytes held from a previous call */
+			if (mccp.held != 0) {
+				telnet_recv(telnet, mark, mccp.held);
+				mccp.held = 0;
+			}
+
+			/* IAC IAC is an escaped data byte, anything else may
+			 * start a new marker */
+			if (bytes[i] == (char)TELNET_IAC && mccp.match != 1)
+				mccp.match = 1;
+			else
+				mccp.match = 0;
+		}
+
+		/* no marker; pass on everything but a held partial match */
+		if (i == len) {
+			if (len > mccp.match - mccp.held)
+				telnet_recv(telnet, bytes, len - (mccp.match - mccp.held));
+			return;
+		}
+
+		/* found the marker; pass on what came before it and start inflating */
+		from = i + 1 - (sizeof(mark) - mccp.held);
+		if (from != 0)
+			telnet_recv(telnet, bytes, from);
+		bytes += i + 1;
+		len -= i + 1;
+		mccp.match = 0;
+		mccp.held = 0;
+
+		memset(&mccp.zs, 0, sizeof(mccp.zs));
+		if (inflateInit(&mccp.zs) != Z_OK) {
+			on_warning("MCCP inflateInit failed");
+			telnet_negotiate(telnet, TELNET_DONT, TELNET_TELOPT_COMPRESS2);
+			return;
+		}
+		mccp.active = 1;
+	}
+}
+#endif
+
+/* ======= ZMP ======= */
+
+static void zmp_ping (size_t argc, const char* argv[]);
+static void zmp_check (size_t argc, const char* argv[]);
+
+static void zmp_noimpl (size_t argc, const char* argv[]);
+
+static struct ZMP zmp_registry[] = {
+	{ "zmp.ping", zmp_ping },
+	{ "zmp.time", zmp_noimpl },
+	{ "zmp.ident", zmp_noimpl },
+	{ "zmp.check", zmp_check },
+	{ "zmp.support", zmp_noimpl },
+	{ "zmp.no-support", zmp_noimpl },
+	{ NULL, NULL }
+};
+
+/* find a registered command */
+static struct ZMPCMD* zmp_find (const char* name, size_t len) {
+	struct ZMPCMD* cmd;
+
+	for (cmd = zmp_commands[hash_name(name, len) % ZMP_BUCKETS]; cmd != NULL; cmd = cmd->next)
+		if (strncmp(cmd->name, name, len) == 0 && cmd->name[len] == '\0')
+			return cmd;
+	return NULL;
+}
+
+/* check whether any registered command lives in a package; the
+ * package name includes its trailing dot */
+static int zmp_has_package (const char* name, size_t len) {
+	struct ZMPPKG* pkg;
+
+	for (pkg = zmp_packages[hash_name(name, len) % ZMP_BUCKETS]; pkg != NULL; pkg = pkg->next)
+		if (pkg->len == len && memcmp(pkg->name, name, len) == 0)
+			return 1;
+	return 0;
+}
+
+/* register a command, replacing any existing handler */
+static void zmp_register (const char* name, void (*cb)(size_t argc, const char* argv[])) {
+	struct ZMPCMD* cmd;
+	struct ZMPPKG* pkg;
+	unsigned int hash;
+	size_t len = strlen(name);
+
+	cmd = zmp_find(name, len);
+	if (cmd != NULL) {
+		cmd->cb = cb;
+		return;
+	}
+
+	cmd = (struct ZMPCMD*)malloc(sizeof(struct ZMPCMD) + len + 1);
+	if (cmd == NULL) {
+		endwin();
+		fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	memcpy(cmd->name, name, len + 1);
+	cmd->cb = cb;
+	hash = hash_name(name, len) % ZMP_BUCKETS;
+	cmd->next = zmp_commands[hash];
+	zmp_commands[hash] = cmd;
+
+	/* "a.b.c" is in packages "a." and "a.b." */
+	for (len = 1; name[len] != '\0'; ++len) {
+		if (name[len - 1] != '.' || zmp_has_package(name, len))
+			continue;
+
+		pkg = (struct ZMPPKG*)malloc(sizeof(struct ZMPPKG) + len);
+		if (pkg == NULL) {
+			endwin();
+			fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		pkg->len = len;
+		memcpy(pkg->name, name, len);
+		hash = hash_name(name, len) % ZMP_BUCKETS;
+		pkg->next = zmp_packages[hash];
+		zmp_packages[hash] = pkg;
+	}
+}
+
+/* register the built-in commands */
+static void zmp_init (void) {
+	size_t i;
+
+	for (i = 0; zmp_registry[i].name != NULL; ++i)
+		zmp_register(zmp_registry[i].name, zmp_registry[i].cb);
+}
+
+/* release all registered commands */
+static void zmp_free (void) {
+	struct ZMPPKG* pkg;
+	struct ZMPCMD* cmd;
+	size_t i;
+
+	for (i = 0; i != ZMP_BUCKETS; ++i) {
+		while ((cmd = zmp_commands[i]) != NULL) {
+			zmp_commands[i] = cmd->next;
+			free(cmd);
+		}
+		while ((pkg = zmp_packages[i]) != NULL) {
+			zmp_packages[i] = pkg->next;
+			free(pkg);
+		}
+	}
+}
+
+/* zmp.ping - requests a time result */
+void zmp_ping (size_t argc, const char* argv[]) {
+	char buf[48];
+	time_t t;
+	time(&t);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+
+	telnet_send_zmpv(telnet, "zmp.time", buf, NULL);
+}
+
+/* zmp.check - asks if pkg/cmd exists, return zmp.support or zmp.no-support */
+void zmp_check (size_t argc, const char* argv[]) {
+	size_t len;
+	int found;
+
+	/* check arguments */
+	if (argc != 2)
+		return;
+	if (argv[1][0] == '\0')
+		return;
+
+	/* are we looking for a package instead of a command? */
+	len = strlen(argv[1]);
+	if (argv[1][len - 1] == '.')
+		found = zmp_has_package(argv[1], len);
+	else
+		found = zmp_find(argv[1], len) != NULL;
+
+	telnet_send_zmpv(telnet, found ? "zmp.support" : "zmp.no-support", argv[1], NULL);
+}
+
+/* no implementation -- stub for commands that need no processing code */
+void zmp_noimpl (size_t argc, const char* argv[]) {
+	/* do nothing */
+}
+
+/* ======= SCAN ======= */
+
+/* length of the run of printable bytes at the start of text; control
+ * bytes are everything below 0x20 plus DEL, high bytes are printable */
+static size_t scan_scalar (const char* text, size_t len) {
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		unsigned char c = (unsigned char)text[i];
+		if (c < 0x20 || c == 0x7f)
+			break;
+	}
+	return i;
+}
+
+/* first copy of needle in hay; nlen must be at least 1 */
+static const char* find_scalar (const char* hay, size_t len, const char* needle, size_t nlen) {
+	const char* p;
+
+	while (len >= nlen && (p = (const char*)memchr(hay, needle[0], len - nlen + 1)) != NULL) {
+		if (memcmp(p, needle, nlen) == 0)
+			return p;
+		len -= p + 1 - hay;
+		hay = p + 1;
+	}
+	return NULL;
+}
+
+/* last copy of needle in hay, looked for a slice at a time from the end,
+ * so recent matches turn up without sweeping everything before them; the
+ * slices start small and double, as common needles are usually close */
+#define FIND_SLICE_MIN 256
+#define FIND_SLICE_MAX (64 * 1024)
+
+static const char* find_last (const char* hay, size_t len, const char* needle, size_t nlen) {
+	const char* last;
+	const char* start;
+	const char* p;
+	size_t lo, hi = len, n;
+	size_t slice = FIND_SLICE_MIN;
+
+	/* matches starting in [lo, hi - nlen] belong to this slice */
+	while (hi >= nlen) {
+		lo = hi - nlen > slice ? hi - nlen - slice : 0;
+		if (slice < FIND_SLICE_MAX)
+			slice *= 2;
+		start = hay + lo;
+		n = hi - lo;
+		last = NULL;
+		while ((p = search_find(start, n, needle, nlen)) != NULL) {
+			last = p;
+			n -= p + 1 - start;
+			start = p + 1;
+		}
+		if (last != NULL)
+			return last;
+		if (lo == 0)
+			break;
+		hi = lo + nlen - 1;
+	}
+	return NULL;
+}
+
+#ifdef HAVE_SIMD_SCAN
+/* there is no unsigned byte compare, so c < 0x20 is min(c, 0x1f) == c */
+__attribute__((target("sse2")))
+static size_t scan_sse2 (const char* text, size_t len) {
+	const __m128i low = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	__m128i v, ctl;
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i*)(text + i));
+		ctl = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, low), v),
+				_mm_cmpeq_epi8(v, del));
+		mask = _mm_movemask_epi8(ctl);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_scalar(text + i, len - i);
+}
+
+/* most runs are short, so probe 16 bytes before going 32 wide */
+__attribute__((target("avx2")))
+static size_t scan_avx2 (const char* text, size_t len) {
+	const __m256i low = _mm256_set1_epi8(0x1f);
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	__m256i v, ctl;
+	size_t i;
+	unsigned int mask;
+
+	if (len < 48)
+		return scan_sse2(text, len);
+	i = scan_sse2(text, 16);
+	if (i != 16)
+		return i;
+
+	for (; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i*)(text + i));
+		ctl = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, low), v),
+				_mm256_cmpeq_epi8(v, del));
+		mask = (unsigned int)_mm256_movemask_epi8(ctl);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_sse2(text + i, len - i);
+}
+
+/* match the first and last bytes of the needle at 16 positions at once,
+ * and only compare the whole needle where both agree */
+__attribute__((target("sse2")))
+static const char* find_sse2 (const char* hay, size_t len, const char* needle, size_t nlen) {
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+	__m128i a, b;
+	size_t i;
+	int mask;
+
+	for (i = 0; i + nlen + 15 <= len; i += 16) {
+		a = _mm_loadu_si128((const __m128i*)(hay + i));
+		b = _mm_loadu_si128((const __m128i*)(hay + i + nlen - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+				_mm_cmpeq_epi8(b, last)));
+		while (mask != 0) {
+			if (memcmp(hay + i + __builtin_ctz(mask), needle, nlen) == 0)
+				return hay + i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+
+	return find_scalar(hay + i, len - i, needle, nlen);
+}
+
+__attribute__((target("avx2")))
+static const char* find_avx2 (const char* hay, size_t len, const char* needle, size_t nlen) {
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+	__m256i a, b;
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + nlen + 31 <= len; i += 32) {
+		a = _mm256_loadu_si256((const __m256i*)(hay + i));
+		b = _mm256_loadu_si256((const __m256i*)(hay + i + nlen - 1));
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(
+				_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		while (mask != 0) {
+			if (memcmp(hay + i + __builtin_ctz(mask), needle, nlen) == 0)
+				return hay + i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+
+	return find_sse2(hay + i, len - i, needle, nlen);
+}
+#endif
+
+static struct SCANNER scanners[] = {
+	{ "scalar", scan_scalar, find_scalar, 1 },
+#ifdef HAVE_SIMD_SCAN
+	{ "sse2", scan_sse2, find_sse2, 0 },
+	{ "avx2", scan_avx2, find_avx2, 0 },
+#endif
+	{ NULL, NULL, NULL, 0 }
+};
+
+/* check the cpu and select the last usable scanner; runs of printable
+ * text are mostly short, where avx2 loses to sse2, so those stay on sse2 */
+static void scan_init (void) {
+	struct SCANNER* s;
+
+#ifdef HAVE_SIMD_SCAN
+	__builtin_cpu_init();
+	scanners[1].usable = __builtin_cpu_supports("sse2");
+	scanners[2].usable = __builtin_cpu_supports("avx2");
+#endif
+
+	for (s = scanners; s->name != NULL; ++s) {
+		if (s->usable) {
+			term_run_length = s->scan;
+			search_find = s->find;
+		}
+	}
+
+#ifdef HAVE_SIMD_SCAN
+	if (scanners[1].usable)
+		term_run_length = scan_sse2;
+#endif
+}
+
+/* ======= UTF-8 ======= */
+
+/* the code points that are not one column wide, from the Unicode 14
+ * character database: nonspacing and enclosing marks, format characters
+ * and Hangul medial vowels are zero wide, East Asian wide and fullwidth
+ * characters two; unassigned gaps inside a range are folded into it */
+static const struct WIDTHRANGE width_ranges[] = {
+	{ 0x0300, 0x036f, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05bd, 0 },
+	{ 0x05bf, 0x05bf, 0 }, { 0x05c1, 0x05c2, 0 }, { 0x05c4, 0x05c5, 0 },
+	{ 0x05c7, 0x05c7, 0 }, { 0x0610, 0x061a, 0 }, { 0x061c, 0x061c, 0 },
+	{ 0x064b, 0x065f, 0 }, { 0x0670, 0x0670, 0 }, { 0x06d6, 0x06dc, 0 },
+	{ 0x06df, 0x06e4, 0 }, { 0x06e7, 0x06e8, 0 }, { 0x06ea, 0x06ed, 0 },
+	{ 0x0711, 0x0711, 0 }, { 0x0730, 0x074a, 0 }, { 0x07a6, 0x07b0, 0 },
+	{ 0x07eb, 0x07f3, 0 }, { 0x07fd, 0x07fd, 0 }, { 0x0816, 0x0819, 0 },
+	{ 0x081b, 0x0823, 0 }, { 0x0825, 0x0827, 0 }, { 0x0829, 0x082d, 0 },
+	{ 0x0859, 0x085b, 0 }, { 0x0898, 0x089f, 0 }, { 0x08ca, 0x08e1, 0 },
+	{ 0x08e3, 0x0902, 0 }, { 0x093a, 0x093a, 0 }, { 0x093c, 0x093c, 0 },
+	{ 0x0941, 0x0948, 0 }, { 0x094d, 0x094d, 0 }, { 0x0951, 0x0957, 0 },
+	{ 0x0962, 0x0963, 0 }, { 0x0981, 0x0981, 0 }, { 0x09bc, 0x09bc, 0 },
+	{ 0x09c1, 0x09c4, 0 }, { 0x09cd, 0x09cd, 0 }, { 0x09e2, 0x09e3, 0 },
+	{ 0x09fe, 0x0a02, 0 }, { 0x0a3c, 0x0a3c, 0 }, { 0x0a41, 0x0a51, 0 },
+	{ 0x0a70, 0x0a71, 0 }, { 0x0a75, 0x0a75, 0 }, { 0x0a81, 0x0a82, 0 },
+	{ 0x0abc, 0x0abc, 0 }, { 0x0ac1, 0x0ac8, 0 }, { 0x0acd, 0x0acd, 0 },
+	{ 0x0ae2, 0x0ae3, 0 }, { 0x0afa, 0x0b01, 0 }, { 0x0b3c, 0x0b3c, 0 },
+	{ 0x0b3f, 0x0b3f, 0 }, { 0x0b41, 0x0b44, 0 }, { 0x0b4d, 0x0b56, 0 },
+	{ 0x0b62, 0x0b63, 0 }, { 0x0b82, 0x0b82, 0 }, { 0x0bc0, 0x0bc0, 0 },
+	{ 0x0bcd, 0x0bcd, 0 }, { 0x0c00, 0x0c00, 0 }, { 0x0c04, 0x0c04, 0 },
+	{ 0x0c3c, 0x0c3c, 0 }, { 0x0c3e, 0x0c40, 0 }, { 0x0c46, 0x0c56, 0 },
+	{ 0x0c62, 0x0c63, 0 }, { 0x0c81, 0x0c81, 0 }, { 0x0cbc, 0x0cbc, 0 },
+	{ 0x0cbf, 0x0cbf, 0 }, { 0x0cc6, 0x0cc6, 0 }, { 0x0ccc, 0x0ccd, 0 },
+	{ 0x0ce2, 0x0ce3, 0 }, { 0x0d00, 0x0d01, 0 }, { 0x0d3b, 0x0d3c, 0 },
+	{ 0x0d41, 0x0d44, 0 }, { 0x0d4d, 0x0d4d, 0 }, { 0x0d62, 0x0d63, 0 },
+	{ 0x0d81, 0x0d81, 0 }, { 0x0dca, 0x0dca, 0 }, { 0x0dd2, 0x0dd6, 0 },
+	{ 0x0e31, 0x0e31, 0 }, { 0x0e34, 0x0e3a, 0 }, { 0x0e47, 0x0e4e, 0 },
+	{ 0x0eb1, 0x0eb1, 0 }, { 0x0eb4, 0x0ebc, 0 }, { 0x0ec8, 0x0ecd, 0 },
+	{ 0x0f18, 0x0f19, 0 }, { 0x0f35, 0x0f35, 0 }, { 0x0f37, 0x0f37, 0 },
+	{ 0x0f39, 0x0f39, 0 }, { 0x0f71, 0x0f7e, 0 }, { 0x0f80, 0x0f84, 0 },
+	{ 0x0f86, 0x0f87, 0 }, { 0x0f8d, 0x0fbc, 0 }, { 0x0fc6, 0x0fc6, 0 },
+	{ 0x102d, 0x1030, 0 }, { 0x1032, 0x1037, 0 }, { 0x1039, 0x103a, 0 },
+	{ 0x103d, 0x103e, 0 }, { 0x1058, 0x1059, 0 }, { 0x105e, 0x1060, 0 },
+	{ 0x1071, 0x1074, 0 }, { 0x1082, 0x1082, 0 }, { 0x1085, 0x1086, 0 },
+	{ 0x108d, 0x108d, 0 }, { 0x109d, 0x109d, 0 }, { 0x1100, 0x115f, 2 },
+	{ 0x1160, 0x11ff, 0 }, { 0x135d, 0x135f, 0 }, { 0x1712, 0x1714, 0 },
+	{ 0x1732, 0x1733, 0 }, { 0x1752, 0x1753, 0 }, { 0x1772, 0x1773, 0 },
+	{ 0x17b4, 0x17b5, 0 }, { 0x17b7, 0x17bd, 0 }, { 0x17c6, 0x17c6, 0 },
+	{ 0x17c9, 0x17d3, 0 }, { 0x17dd, 0x17dd, 0 }, { 0x180b, 0x180f, 0 },
+	{ 0x1885, 0x1886, 0 }, { 0x18a9, 0x18a9, 0 }, { 0x1920, 0x1922, 0 },
+	{ 0x1927, 0x1928, 0 }, { 0x1932, 0x1932, 0 }, { 0x1939, 0x193b, 0 },
+	{ 0x1a17, 0x1a18, 0 }, { 0x1a1b, 0x1a1b, 0 }, { 0x1a56, 0x1a56, 0 },
+	{ 0x1a58, 0x1a60, 0 }, { 0x1a62, 0x1a62, 0 }, { 0x1a65, 0x1a6c, 0 },
+	{ 0x1a73, 0x1a7f, 0 }, { 0x1ab0, 0x1b03, 0 }, { 0x1b34, 0x1b34, 0 },
+	{ 0x1b36, 0x1b3a, 0 }, { 0x1b3c, 0x1b3c, 0 }, { 0x1b42, 0x1b42, 0 },
+	{ 0x1b6b, 0x1b73, 0 }, { 0x1b80, 0x1b81, 0 }, { 0x1ba2, 0x1ba5, 0 },
+	{ 0x1ba8, 0x1ba9, 0 }, { 0x1bab, 0x1bad, 0 }, { 0x1be6, 0x1be6, 0 },
+	{ 0x1be8, 0x1be9, 0 }, { 0x1bed, 0x1bed, 0 }, { 0x1bef, 0x1bf1, 0 },
+	{ 0x1c2c, 0x1c33, 0 }, { 0x1c36, 0x1c37, 0 }, { 0x1cd0, 0x1cd2, 0 },
+	{ 0x1cd4, 0x1ce0, 0 }, { 0x1ce2, 0x1ce8, 0 }, { 0x1ced, 0x1ced, 0 },
+	{ 0x1cf4, 0x1cf4, 0 }, { 0x1cf8, 0x1cf9, 0 }, { 0x1dc0, 0x1dff, 0 },
+	{ 0x200b, 0x200f, 0 }, { 0x202a, 0x202e, 0 }, { 0x2060, 0x206f, 0 },
+	{ 0x20d0, 0x20f0, 0 }, { 0x231a, 0x231b, 2 }, { 0x2329, 0x232a, 2 },
+	{ 0x23e9, 0x23ec, 2 }, { 0x23f0, 0x23f0, 2 }, { 0x23f3, 0x23f3, 2 },
+	{ 0x25fd, 0x25fe, 2 }, { 0x2614, 0x2615, 2 }, { 0x2648, 0x2653, 2 },
+	{ 0x267f, 0x267f, 2 }, { 0x2693, 0x2693, 2 }, { 0x26a1, 0x26a1, 2 },
+	{ 0x26aa, 0x26ab, 2 }, { 0x26bd, 0x26be, 2 }, { 0x26c4, 0x26c5, 2 },
+	{ 0x26ce, 0x26ce, 2 }, { 0x26d4, 0x26d4, 2 }, { 0x26ea, 0x26ea, 2 },
+	{ 0x26f2, 0x26f3, 2 }, { 0x26f5, 0x26f5, 2 }, { 0x26fa, 0x26fa, 2 },
+	{ 0x26fd, 0x26fd, 2 }, { 0x2705, 0x2705, 2 }, { 0x270a, 0x270b, 2 },
+	{ 0x2728, 0x2728, 2 }, { 0x274c, 0x274c, 2 }, { 0x274e, 0x274e, 2 },
+	{ 0x2753, 0x2755, 2 }, { 0x2757, 0x2757, 2 }, { 0x2795, 0x2797, 2 },
+	{ 0x27b0, 0x27b0, 2 }, { 0x27bf, 0x27bf, 2 }, { 0x2b1b, 0x2b1c, 2 },
+	{ 0x2b50, 0x2b50, 2 }, { 0x2b55, 0x2b55, 2 }, { 0x2cef, 0x2cf1, 0 },
+	{ 0x2d7f, 0x2d7f, 0 }, { 0x2de0, 0x2dff, 0 }, { 0x2e80, 0x3029, 2 },
+	{ 0x302a, 0x302d, 0 }, { 0x302e, 0x303e, 2 }, { 0x3041, 0x3096, 2 },
+	{ 0x3099, 0x309a, 0 }, { 0x309b, 0x3247, 2 }, { 0x3250, 0x4dbf, 2 },
+	{ 0x4e00, 0xa4c6, 2 }, { 0xa66f, 0xa672, 0 }, { 0xa674, 0xa67d, 0 },
+	{ 0xa69e, 0xa69f, 0 }, { 0xa6f0, 0xa6f1, 0 }, { 0xa802, 0xa802, 0 },
+	{ 0xa806, 0xa806, 0 }, { 0xa80b, 0xa80b, 0 }, { 0xa825, 0xa826, 0 },
+	{ 0xa82c, 0xa82c, 0 }, { 0xa8c4, 0xa8c5, 0 }, { 0xa8e0, 0xa8f1, 0 },
+	{ 0xa8ff, 0xa8ff, 0 }, { 0xa926, 0xa92d, 0 }, { 0xa947, 0xa951, 0 },
+	{ 0xa960, 0xa97c, 2 }, { 0xa980, 0xa982, 0 }, { 0xa9b3, 0xa9b3, 0 },
+	{ 0xa9b6, 0xa9b9, 0 }, { 0xa9bc, 0xa9bd, 0 }, { 0xa9e5, 0xa9e5, 0 },
+	{ 0xaa29, 0xaa2e, 0 }, { 0xaa31, 0xaa32, 0 }, { 0xaa35, 0xaa36, 0 },
+	{ 0xaa43, 0xaa43, 0 }, { 0xaa4c, 0xaa4c, 0 }, { 0xaa7c, 0xaa7c, 0 },
+	{ 0xaab0, 0xaab0, 0 }, { 0xaab2, 0xaab4, 0 }, { 0xaab7, 0xaab8, 0 },
+	{ 0xaabe, 0xaabf, 0 }, { 0xaac1, 0xaac1, 0 }, { 0xaaec, 0xaaed, 0 },
+	{ 0xaaf6, 0xaaf6, 0 }, { 0xabe5, 0xabe5, 0 }, { 0xabe8, 0xabe8, 0 },
+	{ 0xabed, 0xabed, 0 }, { 0xac00, 0xd7a3, 2 }, { 0xf900, 0xfad9, 2 },
+	{ 0xfb1e, 0xfb1e, 0 }, { 0xfe00, 0xfe0f, 0 }, { 0xfe10, 0xfe19, 2 },
+	{ 0xfe20, 0xfe2f, 0 }, { 0xfe30, 0xfe6b, 2 }, { 0xfeff, 0xfeff, 0 },
+	{ 0xff01, 0xff60, 2 }, { 0xffe0, 0xffe6, 2 }, { 0xfff9, 0xfffb, 0 },
+	{ 0x101fd, 0x101fd, 0 }, { 0x102e0, 0x102e0, 0 },
+	{ 0x10376, 0x1037a, 0 }, { 0x10a01, 0x10a0f, 0 },
+	{ 0x10a38, 0x10a3f, 0 }, { 0x10ae5, 0x10ae6, 0 },
+	{ 0x10d24, 0x10d27, 0 }, { 0x10eab, 0x10eac, 0 },
+	{ 0x10f46, 0x10f50, 0 }, { 0x10f82, 0x10f85, 0 },
+	{ 0x11001, 0x11001, 0 }, { 0x11038, 0x11046, 0 },
+	{ 0x11070, 0x11070, 0 }, { 0x11073, 0x11074, 0 },
+	{ 0x1107f, 0x11081, 0 }, { 0x110b3, 0x110b6, 0 },
+	{ 0x110b9, 0x110ba, 0 }, { 0x110c2, 0x110c2, 0 },
+	{ 0x11100, 0x11102, 0 }, { 0x11127, 0x1112b, 0 },
+	{ 0x1112d, 0x11134, 0 }, { 0x11173, 0x11173, 0 },
+	{ 0x11180, 0x11181, 0 }, { 0x111b6, 0x111be, 0 },
+	{ 0x111c9, 0x111cc, 0 }, { 0x111cf, 0x111cf, 0 },
+	{ 0x1122f, 0x11231, 0 }, { 0x11234, 0x11234, 0 },
+	{ 0x11236, 0x11237, 0 }, { 0x1123e, 0x1123e, 0 },
+	{ 0x112df, 0x112df, 0 }, { 0x112e3, 0x112ea, 0 },
+	{ 0x11300, 0x11301, 0 }, { 0x1133b, 0x1133c, 0 },
+	{ 0x11340, 0x11340, 0 }, { 0x11366, 0x11374, 0 },
+	{ 0x11438, 0x1143f, 0 }, { 0x11442, 0x11444, 0 },
+	{ 0x11446, 0x11446, 0 }, { 0x1145e, 0x1145e, 0 },
+	{ 0x114b3, 0x114b8, 0 }, { 0x114ba, 0x114ba, 0 },
+	{ 0x114bf, 0x114c0, 0 }, { 0x114c2, 0x114c3, 0 },
+	{ 0x115b2, 0x115b5, 0 }, { 0x115bc, 0x115bd, 0 },
+	{ 0x115bf, 0x115c0, 0 }, { 0x115dc, 0x115dd, 0 },
+	{ 0x11633, 0x1163a, 0 }, { 0x1163d, 0x1163d, 0 },
+	{ 0x1163f, 0x11640, 0 }, { 0x116ab, 0x116ab, 0 },
+	{ 0x116ad, 0x116ad, 0 }, { 0x116b0, 0x116b5, 0 },
+	{ 0x116b7, 0x116b7, 0 }, { 0x1171d, 0x1171f, 0 },
+	{ 0x11722, 0x11725, 0 }, { 0x11727, 0x1172b, 0 },
+	{ 0x1182f, 0x11837, 0 }, { 0x11839, 0x1183a, 0 },
+	{ 0x1193b, 0x1193c, 0 }, { 0x1193e, 0x1193e, 0 },
+	{ 0x11943, 0x11943, 0 }, { 0x119d4, 0x119db, 0 },
+	{ 0x119e0, 0x119e0, 0 }, { 0x11a01, 0x11a0a, 0 },
+	{ 0x11a33, 0x11a38, 0 }, { 0x11a3b, 0x11a3e, 0 },
+	{ 0x11a47, 0x11a47, 0 }, { 0x11a51, 0x11a56, 0 },
+	{ 0x11a59, 0x11a5b, 0 }, { 0x11a8a, 0x11a96, 0 },
+	{ 0x11a98, 0x11a99, 0 }, { 0x11c30, 0x11c3d, 0 },
+	{ 0x11c3f, 0x11c3f, 0 }, { 0x11c92, 0x11ca7, 0 },
+	{ 0x11caa, 0x11cb0, 0 }, { 0x11cb2, 0x11cb3, 0 },
+	{ 0x11cb5, 0x11cb6, 0 }, { 0x11d31, 0x11d45, 0 },
+	{ 0x11d47, 0x11d47, 0 }, { 0x11d90, 0x11d91, 0 },
+	{ 0x11d95, 0x11d95, 0 }, { 0x11d97, 0x11d97, 0 },
+	{ 0x11ef3, 0x11ef4, 0 }, { 0x13430, 0x13438, 0 },
+	{ 0x16af0, 0x16af4, 0 }, { 0x16b30, 0x16b36, 0 },
+	{ 0x16f4f, 0x16f4f, 0 }, { 0x16f8f, 0x16f92, 0 },
+	{ 0x16fe0, 0x16fe3, 2 }, { 0x16fe4, 0x16fe4, 0 },
+	{ 0x16ff0, 0x1b2fb, 2 }, { 0x1bc9d, 0x1bc9e, 0 },
+	{ 0x1bca0, 0x1cf46, 0 }, { 0x1d167, 0x1d169, 0 },
+	{ 0x1d173, 0x1d182, 0 }, { 0x1d185, 0x1d18b, 0 },
+	{ 0x1d1aa, 0x1d1ad, 0 }, { 0x1d242, 0x1d244, 0 },
+	{ 0x1da00, 0x1da36, 0 }, { 0x1da3b, 0x1da6c, 0 },
+	{ 0x1da75, 0x1da75, 0 }, { 0x1da84, 0x1da84, 0 },
+	{ 0x1da9b, 0x1daaf, 0 }, { 0x1e000, 0x1e02a, 0 },
+	{ 0x1e130, 0x1e136, 0 }, { 0x1e2ae, 0x1e2ae, 0 },
+	{ 0x1e2ec, 0x1e2ef, 0 }, { 0x1e8d0, 0x1e8d6, 0 },
+	{ 0x1e944, 0x1e94a, 0 }, { 0x1f004, 0x1f004, 2 },
+	{ 0x1f0cf, 0x1f0cf, 2 }, { 0x1f18e, 0x1f18e, 2 },
+	{ 0x1f191, 0x1f19a, 2 }, { 0x1f200, 0x1f320, 2 },
+	{ 0x1f32d, 0x1f335, 2 }, { 0x1f337, 0x1f37c, 2 },
+	{ 0x1f37e, 0x1f393, 2 }, { 0x1f3a0, 0x1f3ca, 2 },
+	{ 0x1f3cf, 0x1f3d3, 2 }, { 0x1f3e0, 0x1f3f0, 2 },
+	{ 0x1f3f4, 0x1f3f4, 2 }, { 0x1f3f8, 0x1f43e, 2 },
+	{ 0x1f440, 0x1f440, 2 }, { 0x1f442, 0x1f4fc, 2 },
+	{ 0x1f4ff, 0x1f53d, 2 }, { 0x1f54b, 0x1f54e, 2 },
+	{ 0x1f550, 0x1f567, 2 }, { 0x1f57a, 0x1f57a, 2 },
+	{ 0x1f595, 0x1f596, 2 }, { 0x1f5a4, 0x1f5a4, 2 },
+	{ 0x1f5fb, 0x1f64f, 2 }, { 0x1f680, 0x1f6c5, 2 },
+	{ 0x1f6cc, 0x1f6cc, 2 }, { 0x1f6d0, 0x1f6d2, 2 },
+	{ 0x1f6d5, 0x1f6df, 2 }, { 0x1f6eb, 0x1f6ec, 2 },
+	{ 0x1f6f4, 0x1f6fc, 2 }, { 0x1f7e0, 0x1f7f0, 2 },
+	{ 0x1f90c, 0x1f93a, 2 }, { 0x1f93c, 0x1f945, 2 },
+	{ 0x1f947, 0x1f9ff, 2 }, { 0x1fa70, 0x1faf6, 2 },
+	{ 0x20000, 0x3fffd, 2 }, { 0xe0001, 0xe01ef, 0 },
+	{ 0x110000, 0x110000, 1 }
+};
+
+/* expand the BMP part of the table to two bits per character */
+static void width_init (void) {
+	const struct WIDTHRANGE* range;
+	unsigned int cp;
+
+	memset(width_bmp, 0x55, sizeof(width_bmp));
+	for (range = width_ranges; range->first < 0x10000; ++range) {
+		for (cp = range->first; cp <= range->last && cp < 0x10000; ++cp) {
+			width_bmp[cp >> 2] &= ~(3 << (cp & 3) * 2);
+			width_bmp[cp >> 2] |= range->width << (cp & 3) * 2;
+		}
+	}
+}
+
+/* columns taken by a code point; past the BMP, the table is searched */
+static int char_width (unsigned int cp) {
+	size_t lo = 0;
+	size_t hi = sizeof(width_ranges) / sizeof(width_ranges[0]) - 1;
+	size_t mid;
+
+	if (cp < 0x10000)
+		return width_bmp[cp >> 2] >> (cp & 3) * 2 & 3;
+
+	/* the last range starting at or before cp */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (width_ranges[mid].first <= cp)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return cp <= width_ranges[lo].last ? width_ranges[lo].width : 1;
+}
+
+/* length of the run of ASCII bytes at the start of text, checked a word
+ * at a time */
+static size_t utf8_ascii_length (const char* text, size_t len) {
+	const unsigned long high = (unsigned long)-1 / 0xff * 0x80;
+	unsigned long word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+		memcpy(&word, text + i, sizeof(word));
+		if ((word & high) != 0)
+			break;
+	}
+	for (; i != len; ++i)
+		if ((unsigned char)text[i] >= 0x80)
+			break;
+	return i;
+}
+
+/* feed bytes to the decoder until a character is finished; returns the
+ * bytes used, and cp is UTF8_NONE if text ran out first.  A byte that
+ * cuts a sequence short is not used, so it starts over on the next call */
+static size_t utf8_decode (const char* text, size_t len, unsigned int* cp) {
+	unsigned char c;
+	size_t i = 0;
+
+	if (terminal.utf8_left == 0) {
+		c = (unsigned char)text[i++];
+		if (c < 0x80) {
+			*cp = c;
+			return 1;
+		} else if (c >= 0xc2 && c <= 0xdf) {
+			terminal.utf8_cp = c & 0x1f;
+			terminal.utf8_min = 0x80;
+			terminal.utf8_left = 1;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			terminal.utf8_cp = c & 0x0f;
+			terminal.utf8_min = 0x800;
+			terminal.utf8_left = 2;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			terminal.utf8_cp = c & 0x07;
+			terminal.utf8_min = 0x10000;
+			terminal.utf8_left = 3;
+		} else {
+			*cp = UTF8_REPLACEMENT;
+			return 1;
+		}
+	}
+
+	for (; i != len; ++i) {
+		c = (unsigned char)text[i];
+		if ((c & 0xc0) != 0x80) {
+			terminal.utf8_left = 0;
+			*cp = UTF8_REPLACEMENT;
+			return i;
+		}
+		terminal.utf8_cp = terminal.utf8_cp << 6 | (c & 0x3f);
+		if (--terminal.utf8_left == 0) {
+			*cp = terminal.utf8_cp;
+			/* overlong forms, surrogates and anything past U+10FFFF */
+			if (*cp < terminal.utf8_min || (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > 0x10ffff)
+				*cp = UTF8_REPLACEMENT;
+			return i + 1;
+		}
+	}
+
+	*cp = UTF8_NONE;
+	return i;
+}
+
+/* decode one character of text that is already complete, with none of the
+ * stream decoder's state; returns the bytes used, at least one, and a
+ * malformed or cut short sequence comes out as the replacement character */
+static size_t utf8_char (const char* text, size_t len, unsigned int* cp) {
+	unsigned char c = (unsigned char)text[0];
+	unsigned int min;
+	size_t n, k;
+
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	} else if (c >= 0xc2 && c <= 0xdf) {
+		n = 2;
+		min = 0x80;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		n = 3;
+		min = 0x800;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		n = 4;
+		min = 0x10000;
+	} else {
+		*cp = UTF8_REPLACEMENT;
+		return 1;
+	}
+
+	*cp = c & (0x7f >> n);
+	for (k = 1; k != n; ++k) {
+		if (k == len || (text[k] & 0xc0) != 0x80) {
+			*cp = UTF8_REPLACEMENT;
+			return k;
+		}
+		*cp = *cp << 6 | (text[k] & 0x3f);
+	}
+	if (*cp < min || (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > 0x10ffff)
+		*cp = UTF8_REPLACEMENT;
+	return n;
+}
+
+/* encode a code point, returning its length */
+static size_t utf8_encode (unsigned int cp, char* out) {
+	if (cp < 0x80) {
+		out[0] = (char)cp;
+		return 1;
+	} else if (cp < 0x800) {
+		out[0] = (char)(0xc0 | cp >> 6);
+		out[1] = (char)(0x80 | (cp & 0x3f));
+		return 2;
+	} else if (cp < 0x10000) {
+		out[0] = (char)(0xe0 | cp >> 12);
+		out[1] = (char)(0x80 | (cp >> 6 & 0x3f));
+		out[2] = (char)(0x80 | (cp & 0x3f));
+		return 3;
+	}
+	out[0] = (char)(0xf0 | cp >> 18);
+	out[1] = (char)(0x80 | (cp >> 12 & 0x3f));
+	out[2] = (char)(0x80 | (cp >> 6 & 0x3f));
+	out[3] = (char)(0x80 | (cp & 0x3f));
+	return 4;
+}
+
+/* ======= CHARSET ======= */
+
+/* code points of bytes 0x80 to 0xff in IBM PC code page 437 */
+static const unsigned short cp437_high[128] = {
+	0x00c7, 0x00fc, 0x00e9, 0x00e2, 0x00e4, 0x00e0, 0x00e5, 0x00e7,
+	0x00ea, 0x00eb, 0x00e8, 0x00ef, 0x00ee, 0x00ec, 0x00c4, 0x00c5,
+	0x00c9, 0x00e6, 0x00c6, 0x00f4, 0x00f6, 0x00f2, 0x00fb, 0x00f9,
+	0x00ff, 0x00d6, 0x00dc, 0x00a2, 0x00a3, 0x00a5, 0x20a7, 0x0192,
+	0x00e1, 0x00ed, 0x00f3, 0x00fa, 0x00f1, 0x00d1, 0x00aa, 0x00ba,
+	0x00bf, 0x2310, 0x00ac, 0x00bd, 0x00bc, 0x00a1, 0x00ab, 0x00bb,
+	0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+	0x2555, 0x2563, 0x2551, 0x2557, 0x255d, 0x255c, 0x255b, 0x2510,
+	0x2514, 0x2534, 0x252c, 0x251c, 0x2500, 0x253c, 0x255e, 0x255f,
+	0x255a, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256c, 0x2567,
+	0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256b,
+	0x256a, 0x2518, 0x250c, 0x2588, 0x2584, 0x258c, 0x2590, 0x2580,
+	0x03b1, 0x00df, 0x0393, 0x03c0, 0x03a3, 0x03c3, 0x00b5, 0x03c4,
+	0x03a6, 0x0398, 0x03a9, 0x03b4, 0x221e, 0x03c6, 0x03b5, 0x2229,
+	0x2261, 0x00b1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00f7, 0x2248,
+	0x00b0, 0x2219, 0x00b7, 0x221a, 0x207f, 0x00b2, 0x25a0, 0x00a0
+};
+
+/* charsets we understand, most preferred first; Latin-1 needs no table
+ * as its bytes are their own code points */
+static const struct CHARSET charsets[] = {
+	{ "UTF-8", "UTF8", NULL, 0 },
+	{ "ISO-8859-1", "LATIN1", NULL, 1 },
+	{ "IBM437", "CP437", cp437_high, 1 },
+	{ "US-ASCII", "ASCII", NULL, 0 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+/* look up a charset by its name or alias, ignoring case */
+static const struct CHARSET* charset_find (const char* name, size_t len) {
+	const struct CHARSET* cs;
+
+	for (cs = charsets; cs->name != NULL; ++cs) {
+		if ((strlen(cs->name) == len && strncasecmp(cs->name, name, len) == 0) ||
+				(strlen(cs->alias) == len && strncasecmp(cs->alias, name, len) == 0))
+			return cs;
+	}
+	return NULL;
+}
+
+/* switch the server text charset, filling the table for legacy ones */
+static void charset_select (const struct CHARSET* cs) {
+	struct CHARSETCODE* code;
+	char bytes[4];
+	int c;
+
+	charset.current = cs;
+	if (!cs->legacy)
+		return;
+
+	for (c = 0; c != 256; ++c) {
+		code = &charset.table[c];
+		code->len = (unsigned char)utf8_encode(c < 0x80 || cs->high == NULL ?
+				(unsigned int)c : cs->high[c - 0x80], bytes);
+		memcpy(code->bytes, bytes, sizeof(code->bytes));
+	}
+}
+
+/* turn legacy text into UTF-8, returning a buffer that lasts until the
+ * next call; ASCII runs are copied whole, and every other byte is one
+ * table lookup and a copy of all four bytes of its entry */
+static const char* charset_decode (const char* text, size_t* len) {
+	size_t need = *len * 3 + 1;
+	size_t i = 0;
+	size_t out = 0;
+	size_t n;
+
+	if (need > charset.size) {
+		free(charset.buf);
+		charset.buf = (char*)malloc(need);
+		if (charset.buf == NULL) {
+			endwin();
+			fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		charset.size = need;
+	}
+
+	while (i < *len) {
+		n = utf8_ascii_length(text + i, *len - i);
+		memcpy(charset.buf + out, text + i, n);
+		out += n;
+		i += n;
+
+		for (; i < *len && (unsigned char)text[i] >= 0x80; ++i) {
+			memcpy(charset.buf + out, &charset.table[(unsigned char)text[i]], 4);
+			out += charset.table[(unsigned char)text[i]].len;
+		}
+	}
+
+	*len = out;
+	return charset.buf;
+}
+
+/* turn typed UTF-8 into the legacy charset, returning the length, which
+ * is never more than len; characters it lacks become '?' */
+static size_t charset_encode (const char* text, size_t len, char* out) {
+	const struct CHARSET* cs = charset.current;
+	unsigned char c;
+	unsigned int cp;
+	size_t i = 0;
+	size_t o = 0;
+	size_t n, k;
+
+	while (i < len) {
+		c = (unsigned char)text[i];
+		if (c < 0x80) {
+			out[o++] = (char)c;
+			++i;
+			continue;
+		}
+
+		/* the sequence length comes from the lead byte */
+		n = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+		cp = c & (0x7f >> n);
+		for (k = 1; k != n && i + k != len && (text[i + k] & 0xc0) == 0x80; ++k)
+			cp = cp << 6 | (text[i + k] & 0x3f);
+		i += k;
+
+		out[o] = '?';
+		if (k == n && n != 1) {
+			if (cs->high == NULL) {
+				if (cp <= 0xff)
+					out[o] = (char)cp;
+			} else {
+				for (k = 0; k != 128; ++k) {
+					if (cs->high[k] == cp) {
+						out[o] = (char)(0x80 + k);
+						break;
+					}
+				}
+			}
+		}
+		++o;
+	}
+	return o;
+}
+
+/* offer every charset we know, once the server lets us */
+static void charset_request (void) {
+	const struct CHARSET* cs;
+	char code = CHARSET_REQUEST;
+
+	telnet_begin_sb(telnet, TELNET_TELOPT_CHARSET);
+	telnet_send(telnet, &code, 1);
+	for (cs = charsets; cs->name != NULL; ++cs) {
+		telnet_send(telnet, ";", 1);
+		telnet_send(telnet, cs->name, strlen(cs->name));
+	}
+	telnet_finish_sb(telnet);
+}
+
+/* send a one byte reply, plus the name of a charset */
+static void charset_reply (char code, const char* name, size_t len) {
+	telnet_begin_sb(telnet, TELNET_TELOPT_CHARSET);
+	telnet_send(telnet, &code, 1);
+	if (len != 0)
+		telnet_send(telnet, name, len);
+	telnet_finish_sb(telnet);
+}
+
+/* handle a CHARSET subnegotiation from the server */
+static void charset_sb (const char* buf, size_t size) {
+	const struct CHARSET* pick = NULL;
+	const struct CHARSET* cs;
+	const char* end = buf + size;
+	const char* name = NULL;
+	const char* start;
+	size_t len = 0;
+	char sep;
+
+	if (size == 0)
+		return;
+
+	switch (buf[0]) {
+	case CHARSET_REQUEST:
+		/* translation tables are never accepted, so the version goes */
+		++buf;
+		if (end - buf >= 9 && memcmp(buf, "[TTABLE]", 8) == 0)
+			buf += 9;
+		if (buf == end) {
+			charset_reply(CHARSET_REJECTED, NULL, 0);
+			break;
+		}
+
+		/* the first byte separates the names; UTF-8 wins if offered,
+		 * otherwise the first one we know */
+		sep = *buf++;
+		while (buf < end) {
+			start = buf;
+			while (buf != end && *buf != sep)
+				++buf;
+			cs = charset_find(start, buf - start);
+			if (cs != NULL && (pick == NULL || cs == charsets)) {
+				pick = cs;
+				name = start;
+				len = buf - start;
+			}
+			if (buf != end)
+				++buf;
+		}
+
+		if (pick == NULL) {
+			charset_reply(CHARSET_REJECTED, NULL, 0);
+			break;
+		}
+		charset_reply(CHARSET_ACCEPTED, name, len);
+		charset_select(pick);
+		on_info("Server charset is %s.", pick->name);
+		break;
+	case CHARSET_ACCEPTED:
+		/* the answer to our own request */
+		cs = charset_find(buf + 1, size - 1);
+		if (cs != NULL) {
+			charset_select(cs);
+			on_info("Server charset is %s.", cs->name);
+		}
+		break;
+	case CHARSET_TTABLE_IS:
+		charset_reply(CHARSET_TTABLE_REJECTED, NULL, 0);
+		break;
+	}
+}
+
+/* release the decode buffer */
+static void charset_free (void) {
+	free(charset.buf);
+	charset.buf = NULL;
+	charset.size = 0;
+}
+
+/* ======= TRIGGER ======= */
+
+static const struct {
+	const char* name;
+	short color;
+} trigger_colors[] = {
+	{ "red", COLOR_RED },
+	{ "green", COLOR_GREEN },
+	{ "yellow", COLOR_YELLOW },
+	{ "blue", COLOR_BLUE },
+	{ "magenta", COLOR_MAGENTA },
+	{ "cyan", COLOR_CYAN },
+	{ "white", COLOR_WHITE },
+	{ NULL, 0 }
+};
+
+/* find the longest run of plain characters every match must contain;
+ * anything inside a group or made optional by a quantifier is skipped,
+ * and alternations have no single required literal at all.  out needs
+ * room for twice the pattern length plus two */
+static size_t trigger_literal (const char* pattern, char* out) {
+	char* run = out + strlen(pattern) + 1;
+	const char* p;
+	size_t len = 0;
+	size_t best = 0;
+	int depth = 0;
+	const char* q;
+	char end[3];
+	char c;
+
+	if (strchr(pattern, '|') != NULL)
+		return 0;
+
+	for (p = pattern; *p != '\0'; ++p) {
+		c = *p;
+
+		/* escaped punctuation is literal; escaped letters and digits are
+		 * classes, word anchors or back references, as are \< \> \` \' */
+		if (c == '\\' && p[1] != '\0') {
+			if (!ispunct((unsigned char)p[1]) || strchr("<>`'", p[1]) != NULL) {
+				++p;
+				len = 0;
+				continue;
+			}
+			c = *++p;
+		} else if (c == '[') {
+			/* skip the bracket expression; a leading ] is literal, and so
+			 * is one inside [:class:], [=equiv=] or [.coll.] */
+			if (p[1] == '^')
+				++p;
+			if (p[1] == ']')
+				++p;
+			while (p[1] != '\0' && p[1] != ']') {
+				if (p[1] == '[' && p[2] != '\0' && strchr(":=.", p[2]) != NULL) {
+					end[0] = p[2];
+					end[1] = ']';
+					end[2] = '\0';
+					if ((q = strstr(p + 3, end)) != NULL) {
+						p = q + 1;
+						continue;
+					}
+				}
+				++p;
+			}
+			if (p[1] != '\0')
+				++p;
+			len = 0;
+			continue;
+		} else if (strchr("\\.()^$*+?{}", c) != NULL) {
+			if (c == '(')
+				++depth;
+			else if (c == ')' && depth > 0)
+				--depth;
+			len = 0;
+			continue;
+		}
+
+		/* an optional character ends the run without joining it */
+		if (depth != 0 || (p[1] != '\0' && strchr("*?{", p[1]) != NULL)) {
+			len = 0;
+			continue;
+		}
+
+		run[len++] = c;
+		if (len > best) {
+			memcpy(out, run, len);
+			best = len;
+		}
+
+		/* a repeated character is required once, but nothing after it is
+		 * adjacent */
+		if (p[1] == '+')
+			len = 0;
+	}
+
+	return best;
+}
+
+/* add a new automaton state */
+static int trigger_state (void) {
+	struct ACSTATE* state;
+
+	if (triggers.nstates == triggers.states_size) {
+		triggers.states_size = triggers.states_size != 0 ? triggers.states_size * 2 : 64;
+		triggers.states = (struct ACSTATE*)realloc(triggers.states,
+				triggers.states_size * sizeof(struct ACSTATE));
+		if (triggers.states == NULL) {
+			fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	state = &triggers.states[triggers.nstates];
+	memset(state->next, 0, sizeof(state->next));
+	state->fail = 0;
+	state->out = -1;
+	state->link = -1;
+	return (int)triggers.nstates++;
+}
+
+/* add a literal to the trie, ending at trigger t */
+static void trigger_insert (const char* literal, size_t len, int t) {
+	int s = 0;
+	int next;
+	size_t i;
+
+	if (triggers.nstates == 0)
+		trigger_state();
+
+	for (i = 0; i != len; ++i) {
+		next = triggers.states[s].next[(unsigned char)literal[i]];
+		if (next == 0) {
+			next = trigger_state();
+			triggers.states[s].next[(unsigned char)literal[i]] = next;
+		}
+		s = next;
+	}
+
+	triggers.list[t].ac_next = triggers.states[s].out;
+	triggers.states[s].out = t;
+}
+
+/* fill in failure links and turn the trie into a full transition table */
+static void trigger_build (void) {
+	struct ACSTATE* states = triggers.states;
+	int* queue;
+	size_t head = 0;
+	size_t tail = 0;
+	int s, c, v, f;
+
+	if (triggers.nstates == 0)
+		return;
+
+	queue = (int*)malloc(triggers.nstates * sizeof(int));
+	if (queue == NULL) {
+		fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	/* breadth first, so every failure target is finished before use */
+	for (c = 0; c != 256; ++c)
+		if (states[0].next[c] != 0)
+			queue[tail++] = states[0].next[c];
+	while (head != tail) {
+		s = queue[head++];
+		for (c = 0; c != 256; ++c) {
+			v = states[s].next[c];
+			if (v == 0) {
+				states[s].next[c] = states[states[s].fail].next[c];
+				continue;
+			}
+			f = states[states[s].fail].next[c];
+			states[v].fail = f;
+			states[v].link = states[f].out != -1 ? f : states[f].link;
+			queue[tail++] = v;
+		}
+	}
+
+	free(queue);
+}
+
+/* load triggers from a file; each line holds an action, a tab, an
+ * extended regex, and for send and highlight another tab and the command
+ * or color:
+ *
+ *   send<TAB>^You are hungry<TAB>eat bread
+ *   highlight<TAB>tells you<TAB>cyan
+ *   gag<TAB>^\[OOC\]
+ */
+static void trigger_load (const char* path) {
+	FILE* file;
+	char buf[TEXTLINE_MAX];
+	char errbuf[256];
+	char* fields[3];
+	struct TRIGGER* trigger;
+	char* literal;
+	size_t len;
+	int lineno = 0;
+	int nfields;
+	int err;
+	int i;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(buf, sizeof(buf), file) != NULL) {
+		++lineno;
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if (buf[0] == '\0' || buf[0] == '#')
+			continue;
+
+		/* split on tabs */
+		fields[0] = buf;
+		for (nfields = 1; nfields != 3; ++nfields) {
+			if ((fields[nfields] = strchr(fields[nfields - 1], '\t')) == NULL)
+				break;
+			*fields[nfields]++ = '\0';
+		}
+		if (nfields < 2) {
+			fprintf(stderr, "%s:%d: expected an action and a pattern\n", path, lineno);
+			exit(1);
+		}
+
+		if (triggers.count == triggers.size) {
+			triggers.size = triggers.size != 0 ? triggers.size * 2 : 16;
+			triggers.list = (struct TRIGGER*)realloc(triggers.list,
+					triggers.size * sizeof(struct TRIGGER));
+			if (triggers.list == NULL) {
+				fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+		trigger = &triggers.list[triggers.count];
+		memset(trigger, 0, sizeof(struct TRIGGER));
+
+		/* action and its argument */
+		if (strcmp(fields[0], "send") == 0) {
+			trigger->action = TRIGGER_SEND;
+			if (nfields != 3) {
+				fprintf(stderr, "%s:%d: send requires a command\n", path, lineno);
+				exit(1);
+			}
+		} else if (strcmp(fields[0], "gag") == 0) {
+			trigger->action = TRIGGER_GAG;
+		} else if (strcmp(fields[0], "highlight") == 0) {
+			trigger->action = TRIGGER_HIGHLIGHT;
+			trigger->color = COLOR_YELLOW;
+			if (nfields == 3) {
+				for (i = 0; trigger_colors[i].name != NULL; ++i)
+					if (strcmp(trigger_colors[i].name, fields[2]) == 0)
+						break;
+				if (trigger_colors[i].name == NULL) {
+					fprintf(stderr, "%s:%d: unknown color %s\n", path, lineno, fields[2]);
+					exit(1);
+				}
+				trigger->color = trigger_colors[i].color;
+			}
+		} else {
+			fprintf(stderr, "%s:%d: unknown action %s\n", path, lineno, fields[0]);
+			exit(1);
+		}
+
+		if ((err = regcomp(&trigger->re, fields[1], REG_EXTENDED | REG_NOSUB)) != 0) {
+			regerror(err, &trigger->re, errbuf, sizeof(errbuf));
+			fprintf(stderr, "%s:%d: %s\n", path, lineno, errbuf);
+			exit(1);
+		}
+		trigger->pattern = strdup(fields[1]);
+		trigger->arg = nfields == 3 ? strdup(fields[2]) : NULL;
+
+		/* prefilter on the required literal, or check every line */
+		literal = (char*)malloc(strlen(fields[1]) * 2 + 2);
+		if (literal == NULL) {
+			fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		if ((len = trigger_literal(fields[1], literal)) != 0) {
+			trigger_insert(literal, len, (int)triggers.count);
+		} else {
+			triggers.always = (int*)realloc(triggers.always,
+					(triggers.nalways + 1) * sizeof(int));
+			if (triggers.always == NULL) {
+				fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+				exit(1);
+			}
+			triggers.always[triggers.nalways++] = (int)triggers.count;
+		}
+		free(literal);
+
+		++triggers.count;
+	}
+	fclose(file);
+
+	trigger_build();
+
+	triggers.cand = (int*)malloc((triggers.count + 1) * sizeof(int));
+	if (triggers.cand == NULL) {
+		fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+/* the rows of the main window the finished line was drawn on; a line
+ * that exactly fills its last row wraps onto a blank one first */
+static int trigger_rows (int* top) {
+	int rows = (int)(textline.cols / getmaxx(win_main)) + 1;
+
+	*top = getcury(win_main) - rows;
+	if (*top < 0) {
+		rows += *top;
+		*top = 0;
+	}
+	return rows;
+}
+
+/* run a matching trigger's action against the finished line */
+static void trigger_fire (struct TRIGGER* trigger) {
+	int top, rows, r;
+
+	switch (trigger->action) {
+		case TRIGGER_SEND:
+			send_line(trigger->arg, strlen(trigger->arg));
+			break;
+		case TRIGGER_GAG:
+			rows = trigger_rows(&top);
+			wmove(win_main, top, 0);
+			winsdelln(win_main, -rows);
+			scrollback_uncommit();
+			break;
+		case TRIGGER_HIGHLIGHT:
+			rows = trigger_rows(&top);
+			for (r = top; r != top + rows; ++r)
+				mvwchgat(win_main, r, 0, -1, A_BOLD, trigger->color, NULL);
+			wmove(win_main, top + rows, 0);
+			scrollback_restyle(A_BOLD | COLOR_PAIR(trigger->color));
+			break;
+	}
+}
+
+static int trigger_compare (const void* a, const void* b) {
+	return *(const int*)a - *(const int*)b;
+}
+
+/* match a finished line; candidates fire in file order, except that
+ * sends wait until every gag and highlight is done, as their echo moves
+ * the cursor and adds a scrollback line */
+static void trigger_line (void) {
+	struct ACSTATE* states = triggers.states;
+	struct TRIGGER* trigger;
+	size_t stamp = ++triggers.lines;
+	size_t ncand = 0;
+	size_t nsend = 0;
+	size_t i;
+	double start = now_sec();
+	double mark;
+	int gagged = 0;
+	int s = 0;
+	int o, t;
+
+	/* literal prefilter */
+	if (states != NULL) {
+		for (i = 0; i != textline.len; ++i) {
+			s = states[s].next[(unsigned char)textline.buf[i]];
+			for (o = states[s].out != -1 ? s : states[s].link; o != -1; o = states[o].link) {
+				for (t = states[o].out; t != -1; t = triggers.list[t].ac_next) {
+					if (triggers.list[t].seen != stamp) {
+						triggers.list[t].seen = stamp;
+						triggers.cand[ncand++] = t;
+					}
+				}
+			}
+		}
+	}
+	for (i = 0; i != triggers.nalways; ++i)
+		triggers.cand[ncand++] = triggers.always[i];
+	if (ncand > 1)
+		qsort(triggers.cand, ncand, sizeof(int), trigger_compare);
+	triggers.candidates += ncand;
+
+	/* confirm with the full regex; once the line is gone, only sends
+	 * still make sense */
+	for (i = 0; i != ncand; ++i) {
+		trigger = &triggers.list[triggers.cand[i]];
+		if (gagged && trigger->action != TRIGGER_SEND)
+			continue;
+		mark = now_sec();
+		++trigger->checks;
+		if (regexec(&trigger->re, textline.buf, 0, NULL, 0) == 0) {
+			++trigger->hits;
+			trigger->time += now_sec() - mark;
+			if (trigger->action == TRIGGER_SEND)
+				triggers.cand[nsend++] = triggers.cand[i];
+			else
+				trigger_fire(trigger);
+			gagged |= trigger->action == TRIGGER_GAG;
+		} else {
+			trigger->time += now_sec() - mark;
+		}
+	}
+
+	/* the sends reuse the front of the candidate list */
+	for (i = 0; i != nsend; ++i)
+		trigger_fire(&triggers.list[triggers.cand[i]]);
+
+	triggers.time += now_sec() - start;
+}
+
+/* print trigger statistics */
+static void trigger_report (void) {
+	struct TRIGGER* trigger;
+	size_t i;
+
+	if (triggers.count == 0)
+		return;
+
+	printf("Triggers: %zu lines, %.2f candidates and %.2f us per line, %zu automaton states.\n",
+			triggers.lines,
+			triggers.lines != 0 ? (double)triggers.candidates / triggers.lines : 0.0,
+			triggers.lines != 0 ? triggers.time * 1e6 / triggers.lines : 0.0,
+			triggers.nstates);
+	printf("%10s %10s %10s  %s\n", "hits", "checks", "us", "pattern");
+	for (i = 0; i != triggers.count; ++i) {
+		trigger = &triggers.list[i];
+		printf("%10zu %10zu %10.0f  %s\n", trigger->hits, trigger->checks,
+				trigger->time * 1e6, trigger->pattern);
+	}
+}
+
+/* release all triggers */
+static void trigger_free (void) {
+	size_t i;
+
+	for (i = 0; i != triggers.count; ++i) {
+		regfree(&triggers.list[i].re);
+		free(triggers.list[i].pattern);
+		free(triggers.list[i].arg);
+	}
+	free(triggers.list);
+	free(triggers.states);
+	free(triggers.always);
+	free(triggers.cand);
+}
+
+/* ======= ALIAS ======= */
+
+/* find an alias by name */
+static struct ALIAS* alias_find (const char* name, size_t len) {
+	struct ALIAS* alias;
+
+	for (alias = aliases[hash_name(name, len) % ALIAS_BUCKETS]; alias != NULL; alias = alias->next)
+		if (strncmp(alias->name, name, len) == 0 && alias->name[len] == '\0')
+			return alias;
+	return NULL;
+}
+
+/* load aliases from a file; each line holds a name, a tab, and the
+ * expansion:
+ *
+ *   kk<TAB>kill $1;get all from corpse
+ *   buffs<TAB>cast armor;cast bless;cast 'stone skin'
+ */
+static void alias_load (const char* path) {
+	FILE* file;
+	char buf[ALIAS_CMD_MAX];
+	struct ALIAS* alias;
+	char* body;
+	unsigned int hash;
+	size_t len;
+	int lineno = 0;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(buf, sizeof(buf), file) != NULL) {
+		++lineno;
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if (buf[0] == '\0' || buf[0] == '#')
+			continue;
+
+		if ((body = strchr(buf, '\t')) == NULL || body == buf) {
+			fprintf(stderr, "%s:%d: expected a name and an expansion\n", path, lineno);
+			exit(1);
+		}
+		*body++ = '\0';
+		len = strlen(buf);
+
+		/* a later definition replaces an earlier one */
+		if ((alias = alias_find(buf, len)) != NULL) {
+			free(alias->body);
+		} else {
+			alias = (struct ALIAS*)malloc(sizeof(struct ALIAS) + len + 1);
+			if (alias == NULL) {
+				fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+				exit(1);
+			}
+			memcpy(alias->name, buf, len + 1);
+			hash = hash_name(buf, len) % ALIAS_BUCKETS;
+			alias->next = aliases[hash];
+			aliases[hash] = alias;
+		}
+		if ((alias->body = strdup(body)) == NULL) {
+			fprintf(stderr, "strdup() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	fclose(file);
+}
+
+/* append to a command being expanded, truncating at ALIAS_CMD_MAX */
+static size_t alias_append (char* cmd, size_t cmdlen, const char* text, size_t len) {
+	if (len > ALIAS_CMD_MAX - cmdlen) {
+		len = ALIAS_CMD_MAX - cmdlen;
+		if (!cmdbuf.truncated)
+			on_warning("alias command is too long, truncated");
+		cmdbuf.truncated = 1;
+	}
+	memcpy(cmd + cmdlen, text, len);
+	return cmdlen + len;
+}
+
+/* expand a line into commands; anything not starting with an alias is
+ * queued as-is */
+static void alias_expand (const char* line, size_t len, int depth) {
+	char cmd[ALIAS_CMD_MAX];
+	size_t cmdlen = 0;
+	const char* args[9];
+	size_t arglen[9];
+	size_t nargs = 0;
+	const char* rest;
+	size_t restlen;
+	struct ALIAS* alias;
+	const char* p;
+	size_t i;
+	int d;
+
+	/* look up the first word, unless it is being expanded already */
+	for (i = 0; i != len && !isspace((unsigned char)line[i]); ++i)
+		;
+	alias = i != 0 ? alias_find(line, i) : NULL;
+	for (d = 0; alias != NULL && d != depth; ++d)
+		if (cmdbuf.chain[d] == alias)
+			alias = NULL;
+	if (alias == NULL) {
+		/* a body like a;a;a;a fans out fast */
+		if (cmdbuf.commands == ALIAS_COMMANDS_MAX) {
+			if (!cmdbuf.capped)
+				on_warning("alias expands to too many commands");
+			cmdbuf.capped = 1;
+			return;
+		}
+		++cmdbuf.commands;
+		send_command(line, len);
+		return;
+	}
+	if (depth == ALIAS_DEPTH_MAX) {
+		on_warning("alias nesting is too deep");
+		return;
+	}
+	cmdbuf.chain[depth] = alias;
+
+	/* the rest of the line, and its words */
+	while (i != len && isspace((unsigned char)line[i]))
+		++i;
+	rest = line + i;
+	restlen = len - i;
+	for (i = 0; i != restlen && nargs != 9; ) {
+		if (isspace((unsigned char)rest[i])) {
+			++i;
+			continue;
+		}
+		args[nargs] = rest + i;
+		while (i != restlen && !isspace((unsigned char)rest[i]))
+			++i;
+		arglen[nargs] = rest + i - args[nargs];
+		++nargs;
+	}
+
+	/* substitute parameters, expanding each command in turn */
+	for (p = alias->body; !cmdbuf.capped; ++p) {
+		if (*p == '\0' || *p == ';') {
+			if (cmdlen != 0)
+				alias_expand(cmd, cmdlen, depth + 1);
+			cmdlen = 0;
+			if (*p == '\0')
+				break;
+		} else if (*p == '\\' && p[1] == ';') {
+			cmdlen = alias_append(cmd, cmdlen, ++p, 1);
+		} else if (*p == '$' && p[1] >= '1' && p[1] <= '9') {
+			i = *++p - '1';
+			if (i < nargs)
+				cmdlen = alias_append(cmd, cmdlen, args[i], arglen[i]);
+		} else if (*p == '$' && p[1] == '*') {
+			++p;
+			cmdlen = alias_append(cmd, cmdlen, rest, restlen);
+		} else {
+			cmdlen = alias_append(cmd, cmdlen, p, 1);
+		}
+	}
+}
+
+/* release all aliases and the command buffer */
+static void alias_free (void) {
+	struct ALIAS* alias;
+	size_t i;
+
+	for (i = 0; i != ALIAS_BUCKETS; ++i) {
+		while ((alias = aliases[i]) != NULL) {
+			aliases[i] = alias->next;
+			free(alias->body);
+			free(alias);
+		}
+	}
+	free(cmdbuf.buf);
+}
+
+/* ======= SOCKET ======= */
+
+static struct SOCKOPT sockopts[] = {
+	{ "nodelay", IPPROTO_TCP, TCP_NODELAY, -1 },
+	{ "rcvbuf", SOL_SOCKET, SO_RCVBUF, -1 },
+	{ "sndbuf", SOL_SOCKET, SO_SNDBUF, -1 },
+	{ "keepalive", SOL_SOCKET, SO_KEEPALIVE, -1 },
+#ifdef TCP_KEEPIDLE
+	{ "keepidle", IPPROTO_TCP, TCP_KEEPIDLE, -1 },
+	{ "keepintvl", IPPROTO_TCP, TCP_KEEPINTVL, -1 },
+	{ "keepcnt", IPPROTO_TCP, TCP_KEEPCNT, -1 },
+#endif
+#ifdef TCP_USER_TIMEOUT
+	{ "user_timeout", IPPROTO_TCP, TCP_USER_TIMEOUT, -1 },
+#endif
+	{ NULL, 0, 0, 0 }
+};
+
+/* set an option's value by name, returns NULL if either is bad */
+static struct SOCKOPT* sockopt_parse (const char* name, const char* value) {
+	struct SOCKOPT* so;
+	char* end;
+	long n;
+
+	for (so = sockopts; so->name != NULL; ++so)
+		if (strcmp(so->name, name) == 0)
+			break;
+	if (so->name == NULL)
+		return NULL;
+
+	n = strtol(value, &end, 10);
+	if (end == value || *end != '\0' || n < 0 || n > 0x7fffffff)
+		return NULL;
+
+	so->value = (int)n;
+	return so;
+}
+
+/* apply every option that was set; SO_RCVBUF has to be in place before
+ * connecting for the window scale to account for it */
+static void sockopt_apply (int fd) {
+	struct SOCKOPT* so;
+
+	for (so = sockopts; so->name != NULL; ++so)
+		if (so->value != -1)
+			setsockopt(fd, so->level, so->opt, &so->value, sizeof(so->value));
+}
+
+/* show what the kernel is actually using, next to what was asked for;
+ * Linux reports buffer sizes doubled to cover its bookkeeping */
+static void sockopt_stats (void) {
+	struct SOCKOPT* so;
+	socklen_t len;
+	int value;
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info info;
+#endif
+
+	if (sock == -1) {
+		on_info("socket: not connected");
+		return;
+	}
+
+	for (so = sockopts; so->name != NULL; ++so) {
+		len = sizeof(value);
+		if (getsockopt(sock, so->level, so->opt, &value, &len) == -1) {
+			on_info("socket: %-12s error: %s", so->name, strerror(errno));
+			continue;
+		}
+		if (so->value == -1)
+			on_info("socket: %-12s %d (default)", so->name, value);
+		else
+			on_info("socket: %-12s %d (set %d)", so->name, value, so->value);
+	}
+
+#if defined(__linux__) && defined(TCP_INFO)
+	len = sizeof(info);
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+		on_info("tcp: rtt %.1f ms (var %.1f), rto %.0f ms, mss %u, cwnd %u",
+				info.tcpi_rtt / 1000.0, info.tcpi_rttvar / 1000.0,
+				info.tcpi_rto / 1000.0, info.tcpi_snd_mss, info.tcpi_snd_cwnd);
+		on_info("tcp: %u retransmits, %u unacked, %ld data segments out",
+				info.tcpi_total_retrans, info.tcpi_unacked, send_segments());
+	}
+#endif
+	on_info("send: %zu bytes, %zu commands in %zu writes, %zu queued",
+			sent_bytes, sent_commands, sent_writes, sendq.len);
+	if (sessionlog.active)
+		on_info("log: %zu lines, %zu dropped, %zu blocked, %zu KB in %zu writes, high water %zu of %d KB",
+				sessionlog.lines, sessionlog.dropped, sessionlog.blocked,
+				atomic_load(&sessionlog.written) / 1024, atomic_load(&sessionlog.writes),
+				sessionlog.high_water / 1024, LOG_RING_SIZE / 1024);
+#ifdef HAVE_ZLIB
+	if (sessionlog.active && sessionlog.zlib && atomic_load(&sessionlog.zlib_bytes) != 0)
+		on_info("log: compressed %zu KB to %zu KB, ratio %.2f, %.1f ms CPU per MB",
+				atomic_load(&sessionlog.raw_bytes) / 1024,
+				atomic_load(&sessionlog.zlib_bytes) / 1024,
+				(double)atomic_load(&sessionlog.raw_bytes) / atomic_load(&sessionlog.zlib_bytes),
+				atomic_load(&sessionlog.cpu_ns) / 1e6 /
+				(atomic_load(&sessionlog.raw_bytes) / 1048576.0));
+#endif
+}
+
+/* handle a line of input; these client commands are taken out, and every
+ * other line goes to the server, # or not:
+ *
+ *   #set <option> <value>   change a socket option on the open connection
+ *   #stats                  show socket options and connection statistics
+ *   ##...                   send the line from the second # on, for a
+ *                           server command that clashes with these
+ */
+static void do_input (const char* line, size_t len) {
+	char buf[256];
+	char* argv[4];
+	size_t argc = 0;
+	char* p;
+
+	if (len >= 2 && line[0] == '#' && line[1] == '#') {
+		send_line(line + 1, len - 1);
+		return;
+	}
+	if (len == 0 || line[0] != '#' || len > sizeof(buf)) {
+		send_line(line, len);
+		return;
+	}
+
+	/* split into words; anything not ours is the server's */
+	memcpy(buf, line + 1, len - 1);
+	buf[len - 1] = '\0';
+	for (p = strtok(buf, " \t"); p != NULL && argc != 4; p = strtok(NULL, " \t"))
+		argv[argc++] = p;
+	if (argc == 0 || (strcmp(argv[0], "set") != 0 && strcmp(argv[0], "stats") != 0)) {
+		send_line(line, len);
+		return;
+	}
+
+	if (argc == 1 && strcmp(argv[0], "stats") == 0) {
+		sockopt_stats();
+	} else if (argc == 3 && strcmp(argv[0], "set") == 0) {
+		struct SOCKOPT* so;
+		/* the connect thread reads the table until it is joined, which
+		 * happens before sock is set */
+		if (sock == -1) {
+			on_warning("not connected; use -o to set socket options before connecting");
+			return;
+		}
+		so = sockopt_parse(argv[1], argv[2]);
+		if (so == NULL)
+			on_warning("unknown socket option or bad value");
+		else if (setsockopt(sock, so->level, so->opt, &so->value, sizeof(so->value)) == -1)
+			on_warning(strerror(errno));
+		else
+			sockopt_stats();
+	} else {
+		on_warning("usage: #set <option> <value>, #stats");
+	}
+}
+
+/* ======= LOG ======= */
+
+/* wake the writer early; the pipe is non-blocking, and a full pipe means
+ * a wakeup is already pending */
+static void log_poke (void) {
+	while (write(sessionlog.wake[1], "", 1) == -1 && errno == EINTR)
+		;
+}
+
+#ifdef HAVE_ZLIB
+/* wall clock time in microseconds, for block timestamps */
+static unsigned long long log_time_us (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* store a little-endian integer */
+static void log_put (unsigned char* out, unsigned long long value, int bytes) {
+	int i;
+	for (i = 0; i != bytes; ++i)
+		out[i] = (unsigned char)(value >> (8 * i));
+}
+
+/* load a little-endian integer */
+static unsigned long long log_get (const unsigned char* in, int bytes) {
+	unsigned long long value = 0;
+	int i;
+	for (i = bytes - 1; i >= 0; --i)
+		value = value << 8 | in[i];
+	return value;
+}
+
+/* write all of a buffer; returns -1 and records the error on failure */
+static int log_write (const char* buf, size_t len) {
+	ssize_t ret;
+
+	while (len != 0) {
+		ret = write(sessionlog.fd, buf, len);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1) {
+			atomic_store(&sessionlog.error, errno);
+			return -1;
+		}
+		atomic_fetch_add(&sessionlog.written, ret);
+		atomic_fetch_add(&sessionlog.writes, 1);
+		sessionlog.offset += ret;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* compress the first len bytes of the pending block and write them out
+ * behind a header; anything after them starts the next block */
+static void log_block_end (size_t len) {
+	unsigned char* header = (unsigned char*)sessionlog.zbuf;
+	struct timespec start, end;
+	unsigned long long offset = sessionlog.offset;
+	unsigned long long first_us = sessionlog.first_us;
+	size_t zlen;
+
+	if (len == 0)
+		return;
+
+	/* the output buffer holds deflateBound() bytes, so one call finishes */
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	deflateReset(&sessionlog.zs);
+	sessionlog.zs.next_in = (Bytef*)sessionlog.raw;
+	sessionlog.zs.avail_in = len;
+	sessionlog.zs.next_out = (Bytef*)sessionlog.zbuf + LOG_BLOCK_HEADER;
+	sessionlog.zs.avail_out = sessionlog.zbuf_size;
+	deflate(&sessionlog.zs, Z_FINISH);
+	zlen = sessionlog.zbuf_size - sessionlog.zs.avail_out;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	atomic_fetch_add(&sessionlog.cpu_ns, (size_t)((end.tv_sec - start.tv_sec) * 1000000000LL +
+			(end.tv_nsec - start.tv_nsec)));
+	atomic_fetch_add(&sessionlog.raw_bytes, len);
+	atomic_fetch_add(&sessionlog.zlib_bytes, zlen);
+
+	log_put(header, len, 4);
+	log_put(header + 4, zlen, 4);
+	log_put(header + 8, sessionlog.first_us, 8);
+	log_put(header + 16, sessionlog.last_us, 8);
+	memmove(sessionlog.raw, sessionlog.raw + len, sessionlog.raw_len - len);
+	sessionlog.raw_len -= len;
+	sessionlog.first_us = sessionlog.last_us;
+
+	/* the block is gone either way; the report says why */
+	if (log_write(sessionlog.zbuf, LOG_BLOCK_HEADER + zlen) == -1) {
+		atomic_store(&sessionlog.error, errno);
+		return;
+	}
+
+	/* without memory for the index, readers fall back to the headers */
+	if (sessionlog.blocks == sessionlog.index_size) {
+		size_t size = sessionlog.index_size != 0 ? sessionlog.index_size * 2 : 64;
+		struct LOGBLOCK* index = (struct LOGBLOCK*)realloc(sessionlog.index,
+				size * sizeof(struct LOGBLOCK));
+		if (index == NULL) {
+			atomic_store(&sessionlog.error, ENOMEM);
+			return;
+		}
+		sessionlog.index = index;
+		sessionlog.index_size = size;
+	}
+	sessionlog.index[sessionlog.blocks].offset = offset;
+	sessionlog.index[sessionlog.blocks].first_us = first_us;
+	sessionlog.index[sessionlog.blocks].last_us = sessionlog.last_us;
+	++sessionlog.blocks;
+}
+
+/* add log text to the pending block, finishing blocks as they fill; a
+ * full block is cut after its last line, so every block starts a line */
+static void log_block_add (const char* text, size_t len) {
+	unsigned long long now = log_time_us();
+	size_t chunk, cut;
+
+	while (len != 0) {
+		if (sessionlog.raw_len == 0) {
+			sessionlog.first_us = now;
+			sessionlog.block_start = now_sec();
+		}
+		sessionlog.last_us = now;
+
+		chunk = LOG_BLOCK_SIZE - sessionlog.raw_len;
+		if (chunk > len)
+			chunk = len;
+		memcpy(sessionlog.raw + sessionlog.raw_len, text, chunk);
+		sessionlog.raw_len += chunk;
+		text += chunk;
+		len -= chunk;
+
+		if (sessionlog.raw_len == LOG_BLOCK_SIZE) {
+			for (cut = LOG_BLOCK_SIZE; cut != 0 && sessionlog.raw[cut - 1] != '\n'; --cut)
+				;
+			log_block_end(cut != 0 ? cut : LOG_BLOCK_SIZE);
+		}
+	}
+}
+
+/* write the block index and the trailer that locates it */
+static void log_index_write (void) {
+	unsigned char entry[LOG_INDEX_ENTRY];
+	unsigned char trailer[LOG_TRAILER];
+	unsigned long long offset = sessionlog.offset;
+	size_t i;
+
+	for (i = 0; i != sessionlog.blocks; ++i) {
+		log_put(entry, sessionlog.index[i].offset, 8);
+		log_put(entry + 8, sessionlog.index[i].first_us, 8);
+		log_put(entry + 16, sessionlog.index[i].last_us, 8);
+		if (log_write((char*)entry, sizeof(entry)) == -1)
+			return;
+	}
+
+	log_put(trailer, offset, 8);
+	log_put(trailer + 8, sessionlog.blocks, 4);
+	memcpy(trailer + 12, LOG_INDEX_MAGIC, 8);
+	log_write((char*)trailer, sizeof(trailer));
+}
+#endif
+
+/* write out everything between tail and head */
+static void log_flush (void) {
+	size_t tail = atomic_load_explicit(&sessionlog.tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&sessionlog.head, memory_order_acquire);
+	size_t off, chunk;
+	struct iovec iov[2];
+	int iovcnt;
+	ssize_t ret;
+	double start = now_sec();
+
+	if (head == tail)
+		return;
+
+	while (head != tail) {
+		off = tail & (LOG_RING_SIZE - 1);
+		chunk = LOG_RING_SIZE - off;
+		iov[0].iov_base = sessionlog.ring + off;
+		iov[0].iov_len = head - tail < chunk ? head - tail : chunk;
+		iov[1].iov_base = sessionlog.ring;
+		iov[1].iov_len = head - tail - iov[0].iov_len;
+		iovcnt = iov[1].iov_len != 0 ? 2 : 1;
+
+#ifdef HAVE_ZLIB
+		/* compression happens here, off the UI thread */
+		if (sessionlog.zlib) {
+			log_block_add((char*)iov[0].iov_base, iov[0].iov_len);
+			log_block_add((char*)iov[1].iov_base, iov[1].iov_len);
+			tail = head;
+			atomic_store_explicit(&sessionlog.tail, tail, memory_order_release);
+			continue;
+		}
+#endif
+
+		ret = writev(sessionlog.fd, iov, iovcnt);
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		/* on a failed write the batch is lost, but the session goes on */
+		if (ret == -1) {
+			atomic_store(&sessionlog.error, errno);
+			ret = head - tail;
+		} else {
+			atomic_fetch_add(&sessionlog.written, ret);
+			atomic_fetch_add(&sessionlog.writes, 1);
+		}
+
+		tail += ret;
+		atomic_store_explicit(&sessionlog.tail, tail, memory_order_release);
+	}
+
+	atomic_fetch_add(&sessionlog.busy_us, (size_t)((now_sec() - start) * 1e6));
+}
+
+/* the writer thread; batches whatever accumulated every LOG_FLUSH_MS, or
+ * sooner when poked */
+static void* log_run (void* ud) {
+	struct pollfd pfd;
+	char drain[64];
+	double last_sync = now_sec();
+
+	pfd.fd = sessionlog.wake[0];
+	pfd.events = POLLIN;
+
+	for (;;) {
+		/* read stop first, so nothing queued before it is missed */
+		int stop = atomic_load_explicit(&sessionlog.stop, memory_order_acquire);
+
+		log_flush();
+#ifdef HAVE_ZLIB
+		/* a quiet session still gets its text to disk */
+		if (sessionlog.zlib && sessionlog.raw_len != 0 &&
+				now_sec() - sessionlog.block_start >= LOG_BLOCK_SECS)
+			log_block_end(sessionlog.raw_len);
+#endif
+		if (now_sec() - last_sync >= LOG_SYNC_SECS) {
+			fdatasync(sessionlog.fd);
+			last_sync = now_sec();
+		}
+		if (stop)
+			break;
+
+		if (poll(&pfd, 1, LOG_FLUSH_MS) > 0)
+			while (read(sessionlog.wake[0], drain, sizeof(drain)) > 0)
+				;
+	}
+
+#ifdef HAVE_ZLIB
+	if (sessionlog.zlib) {
+		log_block_end(sessionlog.raw_len);
+		log_index_write();
+	}
+#endif
+	fdatasync(sessionlog.fd);
+	return NULL;
+}
+
+/* open the log file and start the writer */
+static void log_open (const char* path) {
+	sigset_t all;
+	sigset_t old;
+	int ret;
+
+#ifdef HAVE_ZLIB
+	/* the index only covers one session, so compressed logs start over */
+	if (sessionlog.zlib)
+		sessionlog.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	else
+#endif
+	sessionlog.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (sessionlog.fd == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+#ifdef HAVE_ZLIB
+	if (sessionlog.zlib) {
+		if (deflateInit(&sessionlog.zs, LOG_ZLIB_LEVEL) != Z_OK) {
+			fprintf(stderr, "deflateInit() failed\n");
+			exit(1);
+		}
+		sessionlog.zbuf_size = deflateBound(&sessionlog.zs, LOG_BLOCK_SIZE);
+		sessionlog.raw = (char*)malloc(LOG_BLOCK_SIZE);
+		sessionlog.zbuf = (char*)malloc(LOG_BLOCK_HEADER + sessionlog.zbuf_size);
+		if (sessionlog.raw == NULL || sessionlog.zbuf == NULL) {
+			fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (log_write(LOG_MAGIC, 8) == -1) {
+			fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+	}
+#endif
+
+	sessionlog.ring = (char*)malloc(LOG_RING_SIZE);
+	if (sessionlog.ring == NULL) {
+		fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	if (pipe(sessionlog.wake) == -1) {
+		fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	fcntl(sessionlog.wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(sessionlog.wake[1], F_SETFL, O_NONBLOCK);
+
+	/* signals belong to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&sessionlog.thread, NULL, log_run, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create() failed: %s\n", strerror(ret));
+		exit(1);
+	}
+
+	sessionlog.start = now_sec();
+	sessionlog.active = 1;
+}
+
+/* queue a line for the writer; when the ring is full the line is either
+ * dropped and counted, or with --log-block we wait for room */
+static void log_line (const char* text, size_t len) {
+	size_t head = atomic_load_explicit(&sessionlog.head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&sessionlog.tail, memory_order_acquire);
+	size_t need = len + 1;
+	size_t off, chunk, used;
+	struct timespec ts;
+
+	while (LOG_RING_SIZE - (head - tail) < need) {
+		if (!sessionlog.block) {
+			++sessionlog.dropped;
+			return;
+		}
+		++sessionlog.blocked;
+		log_poke();
+		ts.tv_sec = 0;
+		ts.tv_nsec = 1000000;
+		nanosleep(&ts, NULL);
+		tail = atomic_load_explicit(&sessionlog.tail, memory_order_acquire);
+	}
+
+	/* copy in, wrapping around the end of the ring */
+	off = head & (LOG_RING_SIZE - 1);
+	chunk = LOG_RING_SIZE - off;
+	if (chunk > len)
+		chunk = len;
+	memcpy(sessionlog.ring + off, text, chunk);
+	memcpy(sessionlog.ring, text + chunk, len - chunk);
+	sessionlog.ring[(head + len) & (LOG_RING_SIZE - 1)] = '\n';
+	atomic_store_explicit(&sessionlog.head, head + need, memory_order_release);
+	++sessionlog.lines;
+
+	/* don't wait out the flush interval once the ring is half full */
+	used = head + need - tail;
+	if (used > sessionlog.high_water)
+		sessionlog.high_water = used;
+	if (used >= LOG_RING_SIZE / 2 && used - need < LOG_RING_SIZE / 2)
+		log_poke();
+}
+
+/* stop the writer once it has written everything, and close the file */
+static void log_close (void) {
+	if (!sessionlog.active)
+		return;
+	sessionlog.active = 0;
+
+	atomic_store_explicit(&sessionlog.stop, 1, memory_order_release);
+	log_poke();
+	pthread_join(sessionlog.thread, NULL);
+	sessionlog.elapsed = now_sec() - sessionlog.start;
+
+	close(sessionlog.fd);
+	close(sessionlog.wake[0]);
+	close(sessionlog.wake[1]);
+	free(sessionlog.ring);
+	sessionlog.ring = NULL;
+#ifdef HAVE_ZLIB
+	if (sessionlog.zlib) {
+		deflateEnd(&sessionlog.zs);
+		free(sessionlog.raw);
+		free(sessionlog.zbuf);
+		free(sessionlog.index);
+		sessionlog.raw = sessionlog.zbuf = NULL;
+		sessionlog.index = NULL;
+	}
+#endif
+}
+
+/* print log statistics */
+static void log_report (void) {
+	size_t written = atomic_load(&sessionlog.written);
+	size_t busy_us = atomic_load(&sessionlog.busy_us);
+	size_t text = written;
+
+	if (sessionlog.start == 0)
+		return;
+
+	printf("Logged %zu lines (%zu dropped, %zu waits for room), %zu bytes in %zu writes.\n",
+			sessionlog.lines, sessionlog.dropped, sessionlog.blocked, written,
+			atomic_load(&sessionlog.writes));
+#ifdef HAVE_ZLIB
+	if (sessionlog.zlib)
+		text = atomic_load(&sessionlog.raw_bytes);
+#endif
+	printf("Log writer busy %.1f ms of %.1f s, %.2f MB/s of text while writing.\n",
+			busy_us / 1e3, sessionlog.elapsed,
+			busy_us != 0 ? (double)text / busy_us : 0.0);
+	printf("Log ring high water %zu of %d KB.\n", sessionlog.high_water / 1024,
+			LOG_RING_SIZE / 1024);
+#ifdef HAVE_ZLIB
+	if (sessionlog.zlib && atomic_load(&sessionlog.zlib_bytes) != 0) {
+		size_t raw = atomic_load(&sessionlog.raw_bytes);
+		size_t zlib = atomic_load(&sessionlog.zlib_bytes);
+		printf("Log compressed %zu bytes to %zu in %zu blocks, ratio %.2f, %.1f ms CPU per MB.\n",
+				raw, zlib, sessionlog.blocks, (double)raw / zlib,
+				atomic_load(&sessionlog.cpu_ns) / 1e6 / (raw / 1048576.0));
+	}
+#endif
+	if (atomic_load(&sessionlog.error) != 0)
+		printf("Log writes failed: %s\n", strerror(atomic_load(&sessionlog.error)));
+}
+
+#ifdef HAVE_ZLIB
+/* print a compressed log to stdout, starting from the first block with
+ * lines at or after the given time; the index finds that block without
+ * reading the rest of the file, and a log without one (say, from a crash)
+ * is walked header by header, still without inflating anything skipped */
+static int log_dump (const char* path, double since) {
+	unsigned long long since_us = since > 0 ? (unsigned long long)(since * 1e6) : 0;
+	unsigned char header[LOG_BLOCK_HEADER];
+	unsigned char trailer[LOG_TRAILER];
+	unsigned char* index;
+	char magic[8];
+	char* zbuf = NULL;
+	char* raw = NULL;
+	long offset = 8;
+	long end;
+	size_t count;
+	size_t total = 0;
+	size_t read_blocks = 0;
+	int indexed = 0;
+	FILE* file;
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (fread(magic, 8, 1, file) != 1 || memcmp(magic, LOG_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s is not a compressed log.\n", path);
+		exit(1);
+	}
+	fseek(file, 0, SEEK_END);
+	end = ftell(file);
+
+	/* find the first block through the index */
+	if (end >= 8 + LOG_TRAILER && fseek(file, end - LOG_TRAILER, SEEK_SET) == 0 &&
+			fread(trailer, LOG_TRAILER, 1, file) == 1 &&
+			memcmp(trailer + 12, LOG_INDEX_MAGIC, 8) == 0) {
+		size_t lo = 0, hi, mid;
+
+		count = total = log_get(trailer + 8, 4);
+		indexed = 1;
+		end = log_get(trailer, 8);
+		index = (unsigned char*)malloc(count * LOG_INDEX_ENTRY + 1);
+		if (index == NULL) {
+			fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		fseek(file, end, SEEK_SET);
+		if (fread(index, LOG_INDEX_ENTRY, count, file) != count) {
+			fprintf(stderr, "Failed to read the index of %s.\n", path);
+			exit(1);
+		}
+
+		/* first block whose last line is not before the start time */
+		hi = count;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (log_get(index + mid * LOG_INDEX_ENTRY + 16, 8) < since_us)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		offset = lo < count ? (long)log_get(index + lo * LOG_INDEX_ENTRY, 8) : end;
+		free(index);
+	/* or by hopping over block headers */
+	} else {
+		for (;;) {
+			if (fseek(file, offset, SEEK_SET) != 0 ||
+					fread(header, LOG_BLOCK_HEADER, 1, file) != 1)
+				break;
+			if (log_get(header + 16, 8) >= since_us)
+				break;
+			offset += LOG_BLOCK_HEADER + log_get(header + 4, 4);
+			++total;
+		}
+	}
+
+	/* inflate from there to the end */
+	zbuf = (char*)malloc(compressBound(LOG_BLOCK_SIZE));
+	raw = (char*)malloc(LOG_BLOCK_SIZE);
+	if (zbuf == NULL || raw == NULL) {
+		fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	fseek(file, offset, SEEK_SET);
+	while (offset + LOG_BLOCK_HEADER <= end) {
+		uLongf raw_len;
+		size_t zlen;
+
+		if (fread(header, LOG_BLOCK_HEADER, 1, file) != 1)
+			break;
+		raw_len = log_get(header, 4);
+		zlen = log_get(header + 4, 4);
+		if (raw_len > LOG_BLOCK_SIZE || zlen > compressBound(LOG_BLOCK_SIZE) ||
+				fread(zbuf, zlen, 1, file) != 1 ||
+				uncompress((Bytef*)raw, &raw_len, (Bytef*)zbuf, zlen) != Z_OK) {
+			fprintf(stderr, "Corrupt block at offset %ld of %s.\n", offset, path);
+			break;
+		}
+		fwrite(raw, 1, raw_len, stdout);
+		offset += LOG_BLOCK_HEADER + zlen;
+		++read_blocks;
+	}
+	if (!indexed)
+		total += read_blocks;
+
+	fprintf(stderr, "Read %zu of %zu blocks, found by %s.\n", read_blocks, total,
+			indexed ? "the index" : "block headers");
+	free(zbuf);
+	free(raw);
+	fclose(file);
+	return 0;
+}
+#endif
+
+/* ======= SEARCH ======= */
+
+/* scrollback line (0 being the oldest) holding a text offset */
+static size_t search_line (size_t offset) {
+	size_t lo = 0;
+	size_t hi = scrollback.count;
+	size_t mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (scrollback.lines[(scrollback.head + mid) % scrollback.max].text <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* open the search prompt; the search starts at the bottom of the view */
+static void search_start (void) {
+	struct SCROLLLINE* line;
+
+	search.active = 1;
+	search.pending = 0;
+	search.len = 0;
+	search.origin = scrollback.offset;
+	search.match = SEARCH_NONE;
+	search.start = scrollback.text_head;
+	if (scrollback.offset != 0) {
+		line = &scrollback.lines[(scrollback.head + scrollback.count - scrollback.offset) % scrollback.max];
+		search.start = line->text + line->bytes + 1;
+	}
+	dirty |= DIRTY_BANNER;
+}
+
+/* (re)start the scan for the current pattern below the given offset */
+static void search_run (size_t from) {
+	search.from = from;
+	search.match = SEARCH_NONE;
+	search.scanned = 0;
+	search.busy = 0;
+	search.pending = search.len != 0;
+	if (search.pending)
+		search_step();
+	else if (scrollback.offset != 0)
+		scrollback_render();
+	dirty |= DIRTY_BANNER;
+}
+
+/* scan one slice of text for the last match starting before search.from;
+ * the slice reaches past it by the pattern length less one, so matches
+ * straddling slices are still seen */
+static void search_step (void) {
+	const char* text = scrollback.text - scrollback.text_base;
+	const char* last;
+	size_t lo, hi;
+	double start = now_sec();
+	size_t offset;
+	int rows;
+
+	if (search.from <= scrollback.text_tail) {
+		search.pending = 0;
+		if (scrollback.offset != 0)
+			scrollback_render();
+		dirty |= DIRTY_BANNER;
+		return;
+	}
+
+	lo = search.from - scrollback.text_tail > SEARCH_SLICE ?
+			search.from - SEARCH_SLICE : scrollback.text_tail;
+	hi = search.from + search.len - 1;
+	if (hi > scrollback.text_head)
+		hi = scrollback.text_head;
+
+	last = find_last(text + lo, hi - lo, search.pattern, search.len);
+	search.scanned += search.from - lo;
+	search.from = lo;
+	search.busy += now_sec() - start;
+	dirty |= DIRTY_BANNER;
+
+	if (last == NULL) {
+		/* keep going next iteration, or give up at the oldest line */
+		if (lo == scrollback.text_tail) {
+			search.pending = 0;
+			if (scrollback.offset != 0)
+				scrollback_render();
 		}
+		return;
 	}
 
-	/* ensure we have a host */
-	if (host == NULL) {
-		fprintf(stderr, "No host was given.\nUse -h to see command format.\n");
-		exit(1);
-	}
+	/* center the line with the match in the view, where possible */
+	search.match = last - text;
+	search.pending = 0;
+	rows = getmaxy(win_scroll);
+	offset = scrollback.count - search_line(search.match);
+	offset = offset > (size_t)rows / 2 ? offset - rows / 2 : 1;
+	if (offset == scrollback.offset)
+		scrollback_render();
+	else
+		scrollback_goto(offset);
+}
 
-	/* set default port if none was given */
-	if (port == NULL)
-		port = default_port;
+/* handle a key while the prompt is open; returns 0 for keys that should
+ * get their usual meaning, like paging */
+static int search_key (int key) {
+	/* keep the view where it is */
+	if (key == KEY_ENTER || key == '\n' || key == '\r') {
+		search.active = 0;
+		search.pending = 0;
+		dirty |= DIRTY_BANNER;
 
-	/* cleanup on any failure */
-	atexit(cleanup);
+	/* go back to where the search started */
+	} else if (key == CTRL_KEY('G') || key == 27) {
+		search.active = 0;
+		search.pending = 0;
+		search.len = 0;
+		if (scrollback.offset == search.origin && search.origin != 0)
+			scrollback_render();
+		scrollback_goto(search.origin);
+		dirty |= DIRTY_BANNER;
 
-	/* set terminal defaults */
-	memset(&terminal, 0, sizeof(struct TERMINAL));
-	terminal.state = TERM_ASCII;
-	terminal.flags = TERM_FLAGS_DEFAULT;
-	terminal.color = TERM_COLOR_DEFAULT;
+	/* next older match */
+	} else if (key == CTRL_KEY('F') || key == KEY_UP) {
+		if (search.match != SEARCH_NONE)
+			search_run(search.match);
 
-	/* initial telnet handler */
-	telnet = telnet_init(telnet_telopts, telnet_event, 0, 0);
+	/* a shorter pattern starts over */
+	} else if (key == KEY_BACKSPACE || key == 127 || key == '\b') {
+		if (search.len != 0)
+			--search.len;
+		search.pattern[search.len] = '\0';
+		search_run(search.start);
 
-	/* connect to server */
-	sock = do_connect(host, port);
-	if (sock == -1) {
-		fprintf(stderr, "Failed to connect to %s:%s\n", host, port);
-		exit(1);
+	/* a longer pattern can only match at or before the current match */
+	} else if (key >= 0x20 && key < 0x100 && key != 0x7f) {
+		if (search.len == SEARCH_MAX - 1)
+			return 1;
+		search.pattern[search.len++] = (char)key;
+		search.pattern[search.len] = '\0';
+		search_run(search.match != SEARCH_NONE ? search.match + 1 : search.start);
+
+	} else {
+		return 0;
 	}
-	printf("Connected to %s:%s\n", host, port);
+	return 1;
+}
 
-	/* set initial banner */
-	snprintf(banner, sizeof(banner), "CLC - %s:%s (connected)", host, port);
+/* draw the prompt in win_input */
+static void search_display (void) {
+	mvwaddstr(win_input, 0, 0, "search: ");
+	waddnstr(win_input, search.pattern, search.len);
+}
 
-	/* configure curses */
-	initscr();
-	start_color();
-	nonl();
-	cbreak();
-	noecho();
+/* cells covered by some UTF-8 text, one per byte that starts a character */
+static size_t search_cells (const char* text, size_t len) {
+	size_t cells = 0;
+	size_t i;
 
-	win_main = newwin(LINES-2, COLS, 0, 0);
-	win_banner = newwin(1, COLS, LINES-2, 0);
-	win_input = newwin(1, COLS, LINES-1, 0);
+	for (i = 0; i != len; ++i)
+		cells += ((unsigned char)text[i] & 0xc0) != 0x80;
+	return cells;
+}
 
-	idlok(win_main, TRUE);
-	scrollok(win_main, TRUE);
+/* copy a line's cells, highlighting every match, the current one in bold */
+static const struct SCROLLCELL* search_mark (const struct SCROLLLINE* line, struct SCROLLCELL* out) {
+	const char* text = scrollback.text + (line->text - scrollback.text_base);
+	const char* hay = text;
+	const char* p;
+	size_t len = line->bytes;
+	size_t cell = 0;
+	size_t end;
+	attr_t attr;
 
-	nodelay(win_input, FALSE);
-	keypad(win_input, TRUE);
+	if (line->text < scrollback.text_tail)
+		return line->cells;
 
-	use_default_colors();
+	memcpy(out, line->cells, line->len * sizeof(struct SCROLLCELL));
+	while ((p = search_find(hay, len, search.pattern, search.len)) != NULL) {
+		attr = (size_t)(p - text) + line->text == search.match ? A_REVERSE | A_BOLD : A_REVERSE;
+		cell += search_cells(hay, p - hay);
+		end = cell + search_cells(p, search.len);
+		for (; cell != end && cell != line->len; ++cell)
+			out[cell].attr |= attr;
+		len -= p + search.len - hay;
+		hay = p + search.len;
+	}
+	return out;
+}
 
-	init_pair(COLOR_RED, COLOR_RED, -1);
-	init_pair(COLOR_BLUE, COLOR_BLUE, -1);
-	init_pair(COLOR_GREEN, COLOR_GREEN, -1);
-	init_pair(COLOR_CYAN, COLOR_CYAN, -1);
-	init_pair(COLOR_MAGENTA, COLOR_MAGENTA, -1);
-	init_pair(COLOR_YELLOW, COLOR_YELLOW, -1);
-	init_pair(COLOR_WHITE, COLOR_WHITE, -1);
+/* ======= HISTORY ======= */
 
-	init_pair(TERM_COLOR_DEFAULT, -1, -1);
-	wbkgd(win_main, COLOR_PAIR(TERM_COLOR_DEFAULT));
-	wclear(win_main);
-	init_pair(10, COLOR_WHITE, COLOR_BLUE);
-	wbkgd(win_banner, COLOR_PAIR(10));
-	wclear(win_banner);
-	init_pair(11, -1, -1);
-	wbkgd(win_input, COLOR_PAIR(11));
-	wclear(win_input);
+/* grow the store to hold len more bytes of entries */
+static void history_reserve (size_t len) {
+	size_t used = history.map != NULL ? history.header->used : 0;
+	size_t need = sizeof(struct HISTHEADER) + used + len;
+	size_t size = history.size != 0 ? history.size : HISTORY_SIZE_MIN;
+	char* map;
 
-	redraw_display();
+	if (need <= history.size)
+		return;
+	while (size < need)
+		size *= 2;
 
-	/* set signal handlers */
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = handle_signal;
-	sigaction(SIGINT, &sa, NULL);
-	sigaction(SIGWINCH, &sa, NULL);
+	if (history.fd != -1) {
+		if (ftruncate(history.fd, size) == -1) {
+			endwin();
+			fprintf(stderr, "ftruncate() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (history.map != NULL)
+			munmap(history.map, history.size);
+		map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, history.fd, 0);
+		if (map == MAP_FAILED) {
+			endwin();
+			fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	} else {
+		map = (char*)realloc(history.map, size);
+		if (map == NULL) {
+			endwin();
+			fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
 
-	/* initial edit buffer */
-	memset(&editbuf, 0, sizeof(struct EDITBUF));
+	history.map = map;
+	history.size = size;
+	history.header = (struct HISTHEADER*)map;
+	history.text = map + sizeof(struct HISTHEADER);
+}
 
-	/* setup poll info */
-	struct pollfd fds[2];
-	fds[0].fd = 1;
-	fds[0].events = POLLIN;
-	fds[1].fd = sock;
-	fds[1].events = POLLIN;
+/* map the history file, creating it if needed; a file another clc has
+ * locked is copied into memory and left alone */
+static void history_open (const char* path) {
+	struct stat st;
+	char magic[8];
+	char* map;
+	size_t used;
 
-	/* main loop */
-	while (running) {
-		/* poll sockets */
-		if (poll(fds, 2, -1) == -1) {
-			if (errno != EAGAIN && errno != EINTR) {
-				endwin();
-				fprintf(stderr, "poll() failed: %s\n", strerror(errno));
-				return 1;
-			}
-		}
+	history.fd = -1;
+	history.match = HISTORY_NONE;
+	history.path = path;
 
-		/* resize event? */
-		if (have_sigwinch) {
-			have_sigwinch = 0;
-			redraw_display();
+	if (path != NULL) {
+		history.fd = open(path, O_RDWR | O_CREAT, 0600);
+		if (history.fd == -1 || fstat(history.fd, &st) == -1) {
+			fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+			exit(1);
 		}
-
-		/* escape? */
-		if (have_sigint) {
-			exit(0);
+		if (st.st_size != 0 && (st.st_size < (off_t)sizeof(struct HISTHEADER) ||
+				pread(history.fd, magic, 8, 0) != 8 ||
+				memcmp(magic, HISTORY_MAGIC, 8) != 0)) {
+			fprintf(stderr, "%s is not a history file.\n", path);
+			exit(1);
 		}
 
-		/* input? */
-		if (fds[0].revents & POLLIN) {
-			int key = wgetch(win_input);
-			if (key != ERR)
-				on_key(key);
-		}
+		/* an existing file is mapped as it is */
+		if (flock(history.fd, LOCK_EX | LOCK_NB) == 0) {
+			if (st.st_size != 0) {
+				history.map = (char*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+						MAP_SHARED, history.fd, 0);
+				if (history.map == MAP_FAILED) {
+					fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+					exit(1);
+				}
+				history.size = st.st_size;
+				history.header = (struct HISTHEADER*)history.map;
+				history.text = history.map + sizeof(struct HISTHEADER);
+				if (history.header->used > history.size - sizeof(struct HISTHEADER)) {
+					fprintf(stderr, "%s is not a history file.\n", path);
+					exit(1);
+				}
+				history.pos = history.header->used;
+				return;
+			}
+		} else {
+			fprintf(stderr, "History file %s is in use; this session's history won't be saved.\n", path);
+			if (st.st_size != 0) {
+				map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+				if (map == MAP_FAILED) {
+					fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+					exit(1);
+				}
+				close(history.fd);
+				history.fd = -1;
 
-		/* process input data */
-		if (fds[1].revents & POLLIN) {
-			char buffer[2048];
-			int ret = recv(sock, buffer, sizeof(buffer), 0);
-			if (ret == -1) {
-				if (errno != EAGAIN && errno != EINTR) {
-					endwin();
-					fprintf(stderr, "recv() failed: %s\n", strerror(errno));
-					return 1;
+				/* the holder may be writing, so used is read once and
+				 * must fit in what was mapped */
+				used = ((struct HISTHEADER*)map)->used;
+				if (used > (size_t)st.st_size - sizeof(struct HISTHEADER)) {
+					fprintf(stderr, "%s is not a history file.\n", path);
+					exit(1);
 				}
-			} else if (ret == 0) {
-				running = 0;
-			} else {
-				recv_bytes += ret;
-				telnet_recv(telnet, buffer, ret);
+				history_reserve(used);
+				memcpy(history.map, map, sizeof(struct HISTHEADER) + used);
+				history.header->used = used;
+				munmap(map, st.st_size);
+				history.pos = history.header->used;
+				return;
 			}
+			close(history.fd);
+			history.fd = -1;
 		}
-
-		/* flush output */
-		paint_banner();
-		wnoutrefresh(win_main);
-		wnoutrefresh(win_banner);
-		wnoutrefresh(win_input);
-		doupdate();
 	}
 
-	/* final display, pause */
-	sock = -1;
-	autobanner = 1;
-	paint_banner();
-	wnoutrefresh(win_banner);
-	doupdate();
-	wgetch(win_input);
-
-	/* clean up */
-	endwin();
-	printf("Disconnected.\n");
-
-	/* free memory (so Valgrind leak detection is useful) */
-	telnet_free(telnet);
-
-	return 0;
+	/* a new store */
+	history_reserve(0);
+	memcpy(history.header->magic, HISTORY_MAGIC, 8);
+	history.header->used = 0;
+	history.header->count = 0;
+	history.pos = 0;
 }
 
-/* ======= TELNET ======= */
+/* replace the history file with one holding the entries from cut on; the
+ * new file is locked and complete before it is renamed into place, so
+ * the file at the path is never half trimmed */
+static void history_rewrite (size_t cut, unsigned long long count) {
+	size_t len = history.header->used - cut;
+	char tmp[PATH_MAX];
+	char* map;
+	int fd;
 
-/* telnet event handler */
-static void telnet_event (telnet_t* telnet, telnet_event_t* ev, void* ud) {
-	switch (ev->type) {
-	case TELNET_EV_DATA:
-		on_text_ansi(ev->data.buffer, ev->data.size);
-		break;
-	case TELNET_EV_SEND:
-		do_send(ev->data.buffer, ev->data.size);
-		break;
-	case TELNET_EV_WILL:
-		if (ev->neg.telopt == TELNET_TELOPT_ECHO)
-			terminal.flags &= ~TERM_FLAG_ECHO;
-		else if (ev->neg.telopt == TELNET_TELOPT_ZMP) {
-			terminal.flags |= TERM_FLAG_ZMP;
-			telnet_send_zmpv(telnet, "zmp.ident", "clc", "n/a", "simple command-line client", NULL);
-		}
-		break;
-	case TELNET_EV_WONT:
-		if (ev->neg.telopt == TELNET_TELOPT_ECHO)
-			terminal.flags |= TERM_FLAG_ECHO;
-		break;
-	case TELNET_EV_DO:
-		if (ev->neg.telopt == TELNET_TELOPT_NAWS) {
-			terminal.flags |= TERM_FLAG_NAWS;
-			send_naws();
-		}
-		break;
-	case TELNET_EV_ZMP:
-		do_zmp(ev->zmp.argc, ev->zmp.argv);
-		break;
-	case TELNET_EV_WARNING:
-		wattron(win_main, COLOR_PAIR(COLOR_RED));
-		on_text_plain("\nWARNING:", 8);
-		on_text_plain(ev->error.msg, strlen(ev->error.msg));
-		on_text_plain("\n", 1);
-		wattron(win_main, COLOR_PAIR(terminal.color));
-		break;
-	case TELNET_EV_ERROR:
+	snprintf(tmp, sizeof(tmp), "%s.tmp", history.path);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || flock(fd, LOCK_EX) == -1 || ftruncate(fd, history.size) == -1) {
 		endwin();
-		fprintf(stderr, "TELNET error: %s\n", ev->error.msg);
+		fprintf(stderr, "Failed to rewrite %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+	map = (char*)mmap(NULL, history.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		endwin();
+		fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
 		exit(1);
-	default:
-		break;
 	}
-}
-	
-/* send a line to the server */
-static void send_line (const char* line, size_t len) {
-	telnet_printf(telnet, "%.*s\n", (int)len, line);
 
-	/* echo output */
-	if (terminal.flags & TERM_FLAG_ECHO) {
-		wattron(win_main, COLOR_PAIR(COLOR_YELLOW));
-		on_text_plain(line, len);
-		on_text_plain("\n", 1);
-		wattron(win_main, COLOR_PAIR(terminal.color));
+	memcpy(map, HISTORY_MAGIC, 8);
+	((struct HISTHEADER*)map)->used = len;
+	((struct HISTHEADER*)map)->count = count;
+	memcpy(map + sizeof(struct HISTHEADER), history.text + cut, len);
+	if (fsync(fd) == -1 || rename(tmp, history.path) == -1) {
+		endwin();
+		fprintf(stderr, "Failed to replace %s: %s\n", history.path, strerror(errno));
+		exit(1);
 	}
+
+	/* closing the old file drops its lock; the new one already holds it */
+	munmap(history.map, history.size);
+	close(history.fd);
+	history.fd = fd;
+	history.map = map;
+	history.header = (struct HISTHEADER*)map;
+	history.text = map + sizeof(struct HISTHEADER);
 }
 
-/* send NAWS update */
-static void send_naws (void) {
-	unsigned short w = htons(COLS), h = htons(LINES);
+/* drop the oldest quarter of the entries; kept in memory they are just
+ * moved down, a file is rewritten */
+static void history_trim (void) {
+	size_t used = history.header->used;
+	size_t drop = HISTORY_MAX / 4;
+	size_t cut = 0;
+	const char* p;
 
-	/* send NAWS if enabled */
-	if (terminal.flags & TERM_FLAG_NAWS) {
-		telnet_begin_sb(telnet, TELOPT_NAWS);
-		telnet_send(telnet, (char*)&w, 2);
-		telnet_send(telnet, (char*)&h, 2);
-		telnet_finish_sb(telnet);
+	while (drop != 0 && (p = (const char*)memchr(history.text + cut, '\n', used - cut)) != NULL) {
+		cut = p - history.text + 1;
+		--drop;
+	}
+	if (history.fd != -1) {
+		history_rewrite(cut, history.header->count - (HISTORY_MAX / 4 - drop));
+		return;
 	}
+	memmove(history.text, history.text + cut, used - cut);
+	history.header->used = used - cut;
+	history.header->count -= HISTORY_MAX / 4 - drop;
 }
 
-/* do ZMP */
-static void do_zmp (size_t argc, const char **argv) {
-	size_t i;
+/* record a sent line, unless it is empty, repeats the newest entry, or
+ * was typed with echo off */
+static void history_add (const char* line, size_t len) {
+	size_t used = history.header->used;
+	size_t last;
 
-	/* deal with command */
-	for (i = 0; zmp_registry[i].name != NULL; ++i) {
-		if (strcmp(argv[0], zmp_registry[i].name) == 0) {
-			zmp_registry[i].cb(argc, argv);
-			break;
+	if (len != 0 && (terminal.flags & TERM_FLAG_ECHO) && memchr(line, '\n', len) == NULL) {
+		for (last = used; last != 0 && (last == used || history.text[last - 1] != '\n'); --last)
+			;
+		if (used == 0 || used - 1 - last != len || memcmp(history.text + last, line, len) != 0) {
+			history_reserve(len + 1);
+			memcpy(history.text + used, line, len);
+			history.text[used + len] = '\n';
+
+			/* the entry only counts once it is all there */
+			history.header->used = used + len + 1;
+			if (++history.header->count > HISTORY_MAX)
+				history_trim();
 		}
 	}
+
+	history.pos = history.header->used;
 }
 
-/* ======= ZMP ======= */
+/* put the entry starting at an offset in the edit buffer */
+static void history_show (size_t start) {
+	const char* end = (const char*)memchr(history.text + start, '\n', history.header->used - start);
 
-static void zmp_ping (size_t argc, const char* argv[]);
-static void zmp_check (size_t argc, const char* argv[]);
+	editbuf_setn(history.text + start, end - (history.text + start));
+	history.pos = start;
+}
 
-static void zmp_noimpl (size_t argc, const char* argv[]);
+/* copy the edit line into a buffer, after skip bytes of room; the cursor
+ * stays where it is */
+static char* history_copy (char* buf, size_t skip, size_t* len) {
+	*len = editbuf_len();
+	buf = (char*)realloc(buf, skip + *len + 1);
+	if (buf == NULL) {
+		endwin();
+		fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	editbuf_copy(buf + skip);
+	return buf;
+}
 
-static struct ZMP zmp_registry[] = {
-	{ "zmp.ping", zmp_ping },
-	{ "zmp.time", zmp_noimpl },
-	{ "zmp.ident", zmp_noimpl },
-	{ "zmp.check", zmp_check },
-	{ "zmp.support", zmp_noimpl },
-	{ "zmp.no-support", zmp_noimpl },
-	{ NULL, NULL }
-};
+/* recall the previous entry starting with whatever was typed before the
+ * first recall; entries are found by their preceding newline, and the
+ * oldest, having none, is checked last */
+static void history_prev (void) {
+	size_t used = history.header->used;
+	size_t len;
+	const char* p;
 
-/* zmp.ping - requests a time result */
-void zmp_ping (size_t argc, const char* argv[]) {
-	char buf[48];
-	time_t t;
-	time(&t);
-	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+	if (history.pos == used) {
+		history.saved = history_copy(history.saved, 0, &history.saved_len);
+		history.prefix = history_copy(history.prefix, 1, &history.prefix_len);
+		history.prefix[0] = '\n';
+		++history.prefix_len;
+	}
+	if (history.pos == 0)
+		return;
 
-	telnet_send_zmpv(telnet, "zmp.time", buf, NULL);
+	/* the newline before an older entry sits at or before pos - 2 */
+	len = history.pos - 2 + history.prefix_len;
+	if (len > used)
+		len = used;
+	if (history.pos >= 2 && (p = find_last(history.text, len, history.prefix,
+			history.prefix_len)) != NULL) {
+		history_show(p - history.text + 1);
+		return;
+	}
+	if (used >= history.prefix_len - 1 &&
+			memcmp(history.text, history.prefix + 1, history.prefix_len - 1) == 0)
+		history_show(0);
 }
 
-/* zmp.check - asks if pkg/cmd exists, return zmp.support or zmp.no-support */
-void zmp_check (size_t argc, const char* argv[]) {
-	int pkg = 0;
-	int i;
+/* recall the next entry with the same prefix, or go back to the line
+ * that was being typed */
+static void history_next (void) {
+	size_t used = history.header->used;
+	const char* p;
 
-	/* check arguments */
-	if (argc != 2)
+	if (history.pos == used)
 		return;
-	if (argv[1][0] == '\0')
+
+	p = search_find(history.text + history.pos, used - history.pos,
+			history.prefix, history.prefix_len);
+	if (p != NULL && (size_t)(p - history.text) + 1 < used) {
+		history_show(p - history.text + 1);
+		return;
+	}
+	editbuf_setn(history.saved, history.saved_len);
+	history.pos = used;
+}
+
+/* find the newest entry holding the pattern that starts before from */
+static void history_search_run (size_t from) {
+	const char* p;
+	const char* end;
+
+	history.match = HISTORY_NONE;
+	if (history.len == 0 || from == 0)
 		return;
 
-	/* are we looking for a package instead of a command? */
-	if (argv[1][strlen(argv[1]) - 1] == '.')
-		pkg = 1;
-
-	/* search registry */
-	for (i = 0; zmp_registry[i].name != NULL; ++i) {
-		/* found a matching command? */
-		if (pkg == 0 && strcmp(argv[1], zmp_registry[i].name) == 0) {
-			telnet_send_zmpv(telnet, "zmp.support", argv[1], NULL);
-			return;
-		/* found a matching package? */
-		} else if (pkg == 1 && strncmp(argv[1], zmp_registry[i].name,
-				strlen(argv[1])) == 0) {
-			telnet_send_zmpv(telnet, "zmp.support", argv[1], NULL);
-			return;
-		}
+	p = find_last(history.text, from, history.pattern, history.len);
+	if (p == NULL)
+		return;
+
+	for (end = p; *end != '\n'; ++end)
+		;
+	for (; p != history.text && p[-1] != '\n'; --p)
+		;
+	history.match = p - history.text;
+	history.match_end = end - history.text;
+}
+
+/* open the history search prompt */
+static void history_search_start (void) {
+	history.saved = history_copy(history.saved, 0, &history.saved_len);
+	history.searching = 1;
+	history.len = 0;
+	history.match = HISTORY_NONE;
+}
+
+/* handle a key while the prompt is open; keys it doesn't use take the
+ * match, then get their usual meaning */
+static int history_key (int key) {
+	/* back to the line as it was */
+	if (key == CTRL_KEY('G') || key == 27) {
+		history.searching = 0;
+		editbuf_setn(history.saved, history.saved_len);
+
+	/* next older match */
+	} else if (key == CTRL_KEY('R')) {
+		if (history.match != HISTORY_NONE)
+			history_search_run(history.match);
+
+	/* a shorter pattern starts over */
+	} else if (key == KEY_BACKSPACE || key == 127 || key == '\b') {
+		if (history.len != 0)
+			--history.len;
+		history_search_run(history.header->used);
+
+	/* a longer pattern can still match the current entry */
+	} else if (key >= 0x20 && key < 0x100 && key != 0x7f) {
+		if (history.len == sizeof(history.pattern) - 1)
+			return 1;
+		history.pattern[history.len++] = (char)key;
+		history_search_run(history.match != HISTORY_NONE ? history.match_end + 1 :
+				history.header->used);
+
+	/* take the match; Enter only takes it, without sending */
+	} else {
+		history.searching = 0;
+		if (history.match != HISTORY_NONE)
+			history_show(history.match);
+		return key == KEY_ENTER || key == '\n' || key == '\r';
 	}
+	return 1;
+}
 
-	/* found nothing */
-	telnet_send_zmpv(telnet, "zmp.no-support", argv[1], NULL);
+/* draw the prompt and the match in win_input */
+static void history_display (void) {
+	mvwaddstr(win_input, 0, 0, "history: ");
+	waddnstr(win_input, history.pattern, history.len);
+	waddstr(win_input, history.match != HISTORY_NONE ? " -> " : history.len != 0 ? " (none)" : "");
+	if (history.match != HISTORY_NONE)
+		waddnstr(win_input, history.text + history.match, history.match_end - history.match);
 }
 
-/* no implementation -- stub for commands that need no processing code */
-void zmp_noimpl (size_t argc, const char* argv[]) {
-	/* do nothing */
+/* unmap the history; everything written is already in the file */
+static void history_close (void) {
+	if (history.fd != -1) {
+		munmap(history.map, history.size);
+		close(history.fd);
+	} else {
+		free(history.map);
+	}
+	history.map = NULL;
+	free(history.saved);
+	free(history.prefix);
+	history.saved = history.prefix = NULL;
 }